@@ -3,28 +3,92 @@
 #include <linux/kernel.h>
 #include <linux/sched.h>
 #include <linux/timer.h>
+#include <linux/spinlock.h>
 #include <linux/init.h>
 #include <linux/gpio.h>
 
 #define LED1 2
 
 static struct timer_list blink_timer;
+static struct timer_list blink_backstop;
+static DEFINE_SPINLOCK(blink_lock);
+static bool blink_armed;            /* the next toggle is still to run */
 
 MODULE_LICENSE("GPL");
 
+/*
+ * A relaxed blink uses a deferrable timer rounded to whole seconds,
+ * so it does not wake an idle CPU and shares its wakeups with other
+ * timers rounded the same way. An ordinary backstop timer slack ms
+ * later makes sure a CPU that stays idle does not hold it forever.
+ */
+static bool relaxed;
+module_param(relaxed, bool, S_IRUGO);
+MODULE_PARM_DESC(relaxed, "Let the blink timer wait for other wakeups");
+
+static unsigned int slack = 250;
+module_param(slack, uint, S_IRUGO);
+MODULE_PARM_DESC(slack, "How late a relaxed toggle may come in milliseconds");
+
+static unsigned long blink_start;   /* jiffies at init */
+static unsigned long blink_saved;   /* toggles slept through */
+
+static unsigned long blink_next(void)
+{
+    return relaxed ? round_jiffies(jiffies + HZ) : jiffies + HZ;
+}
+
+/* Called with blink_lock held, or before the timers run */
+static void blink_arm(void)
+{
+    unsigned long expires = blink_next();             // 1 sec.
+
+    blink_armed = true;
+    mod_timer(&blink_timer, expires);
+    if (relaxed)
+        mod_timer(&blink_backstop, expires + msecs_to_jiffies(slack));
+}
+
+/*
+ * Whichever of the two timers fires first toggles the LED, the other
+ * one finds the toggle taken, or the next one not due yet, and does
+ * nothing.
+ */
+static void blink_expired(void)
+{
+    unsigned long data;
+
+    spin_lock(&blink_lock);
+    if (blink_armed && !time_before(jiffies, blink_timer.expires)) {
+        blink_armed = false;
+        del_timer(&blink_timer);
+        del_timer(&blink_backstop);
+
+        /* Every second we were late is a wakeup that did not happen */
+        if (time_after(jiffies, blink_timer.expires + HZ))
+            blink_saved += (jiffies - blink_timer.expires) / HZ;
+
+        data = blink_timer.data;
+        gpio_set_value(LED1, data);
+
+        /* schedule next execution */
+        blink_timer.data = !data;                       // makes the LED toggle
+        blink_arm();
+    }
+    spin_unlock(&blink_lock);
+}
+
 /*
  *  * Timer function called periodically
  *   */
 static void blink_timer_func(unsigned long data)
 {
-    printk(KERN_INFO "%s\n", __func__);
-
-    gpio_set_value(LED1, data); 
-                
-                /* schedule next execution */
-    blink_timer.data = !data;                       // makes the LED toggle 
-    blink_timer.expires = jiffies + (1*HZ);         // 1 sec.
-    add_timer(&blink_timer);
+    blink_expired();
+}
+
+static void blink_backstop_func(unsigned long data)
+{
+    blink_expired();
 }
 
 
@@ -43,12 +107,18 @@ static int __init blinkled_init(void)
     }
 
 
-    init_timer(&blink_timer);
+    if (relaxed)
+        init_timer_deferrable(&blink_timer);
+    else
+        init_timer(&blink_timer);
 
+    init_timer(&blink_backstop);
+
+    blink_start = jiffies;
     blink_timer.function = blink_timer_func;
     blink_timer.data = 1L;
-    blink_timer.expires = jiffies + (1*HZ);
-    add_timer(&blink_timer);
+    blink_backstop.function = blink_backstop_func;
+    blink_arm();
 
     return 0;
 }
@@ -57,8 +127,15 @@ static void __exit blinkled_exit(void)
 {
     printk(KERN_INFO "Blinkled driver exit\n");
 
-    // deactivate timer if running
-    del_timer_sync(&blink_timer);
+    // deactivate timers if running, either may rearm the other
+    do {
+        del_timer_sync(&blink_timer);
+        del_timer_sync(&blink_backstop);
+    } while (timer_pending(&blink_timer) || timer_pending(&blink_backstop));
+
+    if (relaxed)
+        printk(KERN_INFO "Blinkled saved %lu wakeups in %u s\n",
+               blink_saved, jiffies_to_msecs(jiffies - blink_start) / 1000);
 
     // turn the led off
     gpio_set_value(LED1, 0);
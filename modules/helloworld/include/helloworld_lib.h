@@ -0,0 +1,28 @@
+#ifndef HELLOWORLD_LIB_H
+#define HELLOWORLD_LIB_H
+
+#include <linux/helloworld.h>
+
+/*
+ * Userspace wrappers around the /dev/helloworld ioctls. All functions
+ * return 0 or a positive value on success and -1 with errno set on
+ * failure.
+ */
+
+#define HELLOWORLD_DEV_PATH  "/dev/" HELLOWORLD_MODULE_NAME
+#define HELLOWORLD_PROC_PATH "/proc/" HELLOWORLD_MODULE_NAME
+
+extern int helloworld_open(void);
+
+extern int helloworld_close(int fd);
+
+/* Add one message */
+extern int helloworld_inc(int fd);
+
+/*
+ * Add count messages in one call. When sum is not NULL the exact
+ * total afterwards is stored there.
+ */
+extern int helloworld_add(int fd, long long count, long long *sum);
+
+#endif /* HELLOWORLD_LIB_H */
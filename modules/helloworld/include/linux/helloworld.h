@@ -1,6 +1,9 @@
 #ifndef HELLOWORLD_H
 #define HELLOWORLD_H
 
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
 /* 
  * ===============================================
  *             HELLOWORLD Data Structures
@@ -18,27 +21,19 @@
 #ifdef __KERNEL__
 
 
-/* 
- * We want to put datastream instrumentation points in the code in
- * general, but we also want to illustrate how to create a
- * "production" version of the module without instrumentation so we
- * control inclusion of the DSKI header with this kernel config
- * symbol. 
- * 
- * Note that we also define that we also define the HELLOWORLD_DEBUG
- * statement is used in place of printk to include narrative debug
- * statements in the datastream output.
+/*
+ * Instrumentation points are tracepoints, see kmod/helloworld_trace.h.
+ * They cost nothing until enabled, so there is no separate
+ * "production" build without them any more.
  */
-#ifdef CONFIG_KUSP_HELLOWORLD_DSKI
-#include <linux/kusp/dski.h>
-#define HELLOWORLD_DEBUG(fmt, args...) DSTRM_DEBUG(HELLOWORLD, DEBUG, fmt, ## args)
-#else
-#define HELLOWORLD_DEBUG(fmt, args...) 
-#endif /* CONFIG_KUSP_HELLOWORLD_DSKI */
 
 
-
-extern atomic_t helloworld_print_count;
+/*
+ * Number of "Hello World!" lines in /proc/helloworld. Per-CPU so that
+ * concurrent increments from many cores do not fight over one cache
+ * line.
+ */
+extern struct percpu_counter helloworld_message_count;
 
 
 /*
@@ -64,6 +59,22 @@ typedef struct helloworld_ioctl_inc_s {
 	int placeholder;
 } helloworld_ioctl_inc_t;
 
+/*
+ * Add count messages in one call. With HELLOWORLD_ADD_SUM set in
+ * flags the exact total after the add is returned in sum, otherwise
+ * sum is left alone. Summing walks every CPU, so callers that only
+ * count should leave it off. Unknown flags and a non-zero reserved
+ * fail with EINVAL.
+ */
+#define HELLOWORLD_ADD_SUM	0x1
+
+typedef struct helloworld_ioctl_add_s {
+	__s64 count;
+	__u32 flags;
+	__u32 reserved;
+	__s64 sum;
+} helloworld_ioctl_add_t;
+
 /* 
  * This generic union allows us to make a more generic IOCTRL call
  * interface. Each per-IOCTL-flavor struct should be a member of this
@@ -71,6 +82,7 @@ typedef struct helloworld_ioctl_inc_s {
  */
 typedef union helloworld_ioctl_param_u {
 	helloworld_ioctl_inc_t      set;
+	helloworld_ioctl_add_t      add;
 } helloworld_ioctl_param_union;
 
 
@@ -89,6 +101,7 @@ typedef union helloworld_ioctl_param_u {
  * (hopefully) unique constants used for IOCTL command values.
  */
 #define HELLOWORLD_IOCTL_INCREMENT	   _IOW(HELLOWORLD_MAGIC, 1, helloworld_ioctl_inc_t)
+#define HELLOWORLD_IOCTL_ADD		   _IOWR(HELLOWORLD_MAGIC, 2, helloworld_ioctl_add_t)
 
 
 #endif /* HELLOWORLD_H */
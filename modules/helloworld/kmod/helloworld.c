@@ -6,7 +6,9 @@
 #include <linux/fs.h>
 #include <linux/miscdevice.h>
 #include <linux/module.h>
+#include <linux/percpu_counter.h>
 #include <linux/proc_fs.h>
+#include <linux/seq_file.h>
 #include <linux/types.h>
 
 /* 
@@ -28,8 +30,12 @@
  */
 #include "../include/linux/helloworld.h"
 
+#define CREATE_TRACE_POINTS
+#include "helloworld_trace.h"
+
+static int helloworld_proc_open(struct inode *inode, struct file *file);
 static ssize_t helloworld_proc_read(struct file *file,
-                                char *buffer,
+                                char __user *buffer,
                                 size_t buffer_length,
                                 loff_t *offset_ptr);
 
@@ -37,7 +43,7 @@ static ssize_t helloworld_proc_read(struct file *file,
  * The number of times to append the line "Hello World!" to the
  * /proc/helloworld buffer.
  */
-atomic_t helloworld_message_count = ATOMIC_INIT(0);
+struct percpu_counter helloworld_message_count;
 
 /*
  * Required Proc File-system Struct
@@ -47,8 +53,11 @@ atomic_t helloworld_message_count = ATOMIC_INIT(0);
 struct proc_dir_entry *helloworld_proc_entry;
 
 const struct file_operations proc_file_fops = {
-    .owner = THIS_MODULE,
-    .read  = helloworld_proc_read,
+    .owner   = THIS_MODULE,
+    .open    = helloworld_proc_open,
+    .read    = helloworld_proc_read,
+    .llseek  = seq_lseek,
+    .release = seq_release_private,
 };
 
 /* 
@@ -63,7 +72,28 @@ const struct file_operations proc_file_fops = {
  */
 static void 
 helloworld_inc_message_count(void){
-	atomic_inc(&helloworld_message_count);
+	percpu_counter_inc(&helloworld_message_count);
+}
+
+/*
+ * Add count messages at once. Increments stay in a per-CPU delta
+ * until it grows past the batch size, so only the rare fold into the
+ * global count touches shared memory. Returns the exact total when
+ * asked for, which has to visit every CPU.
+ */
+static int
+helloworld_add_message_count(helloworld_ioctl_add_t *add)
+{
+	if (add->count < 0 || (add->flags & ~HELLOWORLD_ADD_SUM) ||
+	    add->reserved)
+		return -EINVAL;
+
+	percpu_counter_add(&helloworld_message_count, add->count);
+
+	if (add->flags & HELLOWORLD_ADD_SUM)
+		add->sum = percpu_counter_sum_positive(&helloworld_message_count);
+
+	return 0;
 }
 
 
@@ -94,11 +124,19 @@ helloworld_ioctl(struct file *file, unsigned int ioctl_num, unsigned long ioctl_
 	int                               ret = 0;
 	helloworld_ioctl_param_union      local_param;
 
-	printk("helloworld_ioctl()\n");
+	trace_helloworld_ioctl_enter(ioctl_num);
 
-	if (copy_from_user
-	    ((void *)&local_param, (void *)ioctl_param, _IOC_SIZE(ioctl_num)))
-		return  -ENOMEM;
+	/*
+	 * The increment argument is a placeholder, there is nothing to
+	 * copy for it.
+	 */
+	if (ioctl_num != HELLOWORLD_IOCTL_INCREMENT &&
+	    _IOC_SIZE(ioctl_num) <= sizeof(local_param) &&
+	    copy_from_user
+	    ((void *)&local_param, (void *)ioctl_param, _IOC_SIZE(ioctl_num))) {
+		ret = -ENOMEM;
+		goto out;
+	}
 
 	switch (ioctl_num) {
 
@@ -109,14 +147,24 @@ helloworld_ioctl(struct file *file, unsigned int ioctl_num, unsigned long ioctl_
 		break;
 	}
 
+	case HELLOWORLD_IOCTL_ADD:
+	{
+		ret = helloworld_add_message_count(&local_param.add);
+		if (ret == 0 && (local_param.add.flags & HELLOWORLD_ADD_SUM) &&
+		    copy_to_user((void *)ioctl_param, &local_param.add,
+				 sizeof(local_param.add)))
+			ret = -EFAULT;
+		break;
+	}
+
 	default:
 	{
-		printk("ioctl: no such command\n");
 		ret = -EINVAL;
 	}
 	} /* end of switch(ioctl_num) */
 
-	
+out:
+	trace_helloworld_ioctl_exit(ioctl_num, ret);
 	return ret;
 }
 
@@ -129,75 +177,85 @@ helloworld_ioctl(struct file *file, unsigned int ioctl_num, unsigned long ioctl_
  * ===============================================
  */
 
-/* 
- * The type and order of the parameters is standard for a /proc/ read
- * routine, at least, and possibly for all read routines but we didn't
- * go and check this assuption yet.
+/*
+ * /proc/helloworld is a seq_file with one record per message, so the
+ * output is produced a page at a time as the reader asks for it
+ * instead of being built in one go. Memory use does not depend on the
+ * message count, a read continues where the previous one stopped and
+ * lseek() works.
  *
+ * The record iterator is the file position itself, which seq_file
+ * keeps for us. It is never NULL while it is valid, which is what
+ * start() and next() have to return to keep going.
  */
-static ssize_t helloworld_proc_read(struct file *file,
-                                char *buffer,
-				                size_t buffer_length,
-				                loff_t *offset_ptr) {
-	int ret;
-	int i;
-    int offset = *offset_ptr;
+static void *
+helloworld_seq_start(struct seq_file *m, loff_t *pos)
+{
+	int *message_count = m->private;
 
-	/* 
-	 * Obtain a local copy of the atomic variable that is
-	 * gaurenteed not to change while in the buffer formatting
-	 * logic..
-	 */
-	int message_count = atomic_read(&helloworld_message_count);
+	return *pos < *message_count ? pos : NULL;
+}
 
-	printk("reading helloworld proc entry.\n");
-	
-	/* 
-	 * We give all of our information in one go, so if the user
-	 * asks us if we have more information the answer should
-	 * always be no.
-	 *
-	 * This is important because the standard read function from
-	 * the library would continue to issue the read system call
-	 * until the kernel replies that it has no more information,
-	 * or until its buffer is filled.
-	 * 
-	 */
-	if (offset > 0) {
-		/* we have finished to read, return 0 */
-		ret  = 0;
-	} else {
-		/* fill the buffer, return the buffeint buffer_lengthr size This
-		 * assumes that the buffer passed in is big enough to
-		 * hold what we put in it. More defensive code would
-		 * check the input buffer_length parameter to check
-		 * the validity of that assumption.
-		 *
-		 * Note that the return value from this call (number
-		 * of characters written to the buffer) from this will
-		 * be added to the current offset at the file
-		 * descriptor level managed by the system code that is
-		 * called by this routine.
-		 */
-		
-		/* 
-		 * Make sure we are starting off with a clean buffer;
-		 */
-		strcpy(buffer, "");
-		for (i = 0; i < message_count; i ++) {
-			/* 
-			 * Now that we are sure what the buffer
-			 * contains we can just append the message the
-			 * desired number of times. The third argument
-			 * to strncat() makes sure we do not go over
-			 * the length of the buffer.
-			 */
-			buffer = strncat(buffer, "Hello World!\n", 
-				(buffer_length - strlen(buffer)) );		
-		}
-		ret = strlen(buffer);
-	}
+static void *
+helloworld_seq_next(struct seq_file *m, void *v, loff_t *pos)
+{
+	int *message_count = m->private;
 
+	++*pos;
+	return *pos < *message_count ? pos : NULL;
+}
+
+static void
+helloworld_seq_stop(struct seq_file *m, void *v)
+{
+}
+
+static int
+helloworld_seq_show(struct seq_file *m, void *v)
+{
+	seq_puts(m, "Hello World!\n");
+	return 0;
+}
+
+static const struct seq_operations
+helloworld_seq_ops = {
+	.start = helloworld_seq_start,
+	.next  = helloworld_seq_next,
+	.stop  = helloworld_seq_stop,
+	.show  = helloworld_seq_show,
+};
+
+/*
+ * The message count is sampled once per open so that every read
+ * of one file descriptor sees the same number of lines, even while
+ * other processes keep incrementing it.
+ */
+static int
+helloworld_proc_open(struct inode *inode, struct file *file)
+{
+	int *message_count;
+
+	message_count = seq_open_private(file, &helloworld_seq_ops,
+					 sizeof(*message_count));
+	if (message_count == NULL)
+		return -ENOMEM;
+
+	*message_count = min_t(s64, INT_MAX,
+		percpu_counter_sum_positive(&helloworld_message_count));
+	return 0;
+}
+
+static ssize_t
+helloworld_proc_read(struct file *file, char __user *buffer,
+		     size_t buffer_length, loff_t *offset_ptr)
+{
+	struct seq_file *m = file->private_data;
+	loff_t offset = *offset_ptr;
+	ssize_t ret;
+
+	ret = seq_read(file, buffer, buffer_length, offset_ptr);
+
+	trace_helloworld_proc_read(*(int *)m->private, offset, ret);
 	return ret;
 }
 
@@ -245,6 +303,10 @@ __init helloworld_init(void)
 {
 	int ret = 0;
 
+	ret = percpu_counter_init(&helloworld_message_count, 0, GFP_KERNEL);
+	if (ret < 0)
+		goto out;
+
 	/*
 	 * Attempt to register the module as a misc. device with the
 	 * kernel.
@@ -253,7 +315,7 @@ __init helloworld_init(void)
 
 	if (ret < 0) {
 		/* Registration failed so give up. */
-		goto out;
+		goto misc_fail;
 	}
 
 	/* 
@@ -272,13 +334,17 @@ __init helloworld_init(void)
 		 * an existing error number.
 		 */
 		ret = -ENOMEM;
-		goto out;
+		goto proc_fail;
 	}
 
 	printk("helloworld module installed\n");
 
+	return 0;
 
-
+proc_fail:
+	misc_deregister(&helloworld_misc);
+misc_fail:
+	percpu_counter_destroy(&helloworld_message_count);
 out:
 	return ret;
 }
@@ -290,6 +356,8 @@ __exit helloworld_exit(void)
 
 	misc_deregister(&helloworld_misc);
 
+	percpu_counter_destroy(&helloworld_message_count);
+
 	printk("helloworld module uninstalled\n");
 }
 
@@ -0,0 +1,82 @@
+/*
+ * helloworld_trace.h - Tracepoints of the helloworld kmod
+ *
+ * These replace the old DSKI instrumentation. Nothing is recorded
+ * unless the events are enabled, e.g.
+ *
+ *   echo 1 > /sys/kernel/debug/tracing/events/helloworld/enable
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM helloworld
+
+#if !defined(_HELLOWORLD_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _HELLOWORLD_TRACE_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(helloworld_ioctl_enter,
+
+	TP_PROTO(unsigned int cmd),
+
+	TP_ARGS(cmd),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, cmd)
+	),
+
+	TP_fast_assign(
+		__entry->cmd = cmd;
+	),
+
+	TP_printk("cmd=0x%x", __entry->cmd)
+);
+
+TRACE_EVENT(helloworld_ioctl_exit,
+
+	TP_PROTO(unsigned int cmd, long ret),
+
+	TP_ARGS(cmd, ret),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, cmd)
+		__field(long, ret)
+	),
+
+	TP_fast_assign(
+		__entry->cmd = cmd;
+		__entry->ret = ret;
+	),
+
+	TP_printk("cmd=0x%x ret=%ld", __entry->cmd, __entry->ret)
+);
+
+TRACE_EVENT(helloworld_proc_read,
+
+	TP_PROTO(int message_count, loff_t offset, ssize_t ret),
+
+	TP_ARGS(message_count, offset, ret),
+
+	TP_STRUCT__entry(
+		__field(int, message_count)
+		__field(loff_t, offset)
+		__field(ssize_t, ret)
+	),
+
+	TP_fast_assign(
+		__entry->message_count = message_count;
+		__entry->offset        = offset;
+		__entry->ret           = ret;
+	),
+
+	TP_printk("message_count=%d offset=%lld ret=%zd",
+		  __entry->message_count, __entry->offset, __entry->ret)
+);
+
+#endif /* _HELLOWORLD_TRACE_H */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE helloworld_trace
+#include <trace/define_trace.h>
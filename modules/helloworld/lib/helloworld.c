@@ -0,0 +1,47 @@
+/*
+ * helloworld.c - Userspace library for the helloworld kmod
+ *
+ */
+#include <fcntl.h>
+#include <stddef.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include <linux/helloworld.h>
+#include <helloworld_lib.h>
+
+int
+helloworld_open(void)
+{
+	return open(HELLOWORLD_DEV_PATH, O_RDWR);
+}
+
+int
+helloworld_close(int fd)
+{
+	return close(fd);
+}
+
+int
+helloworld_inc(int fd)
+{
+	helloworld_ioctl_inc_t inc = { 0 };
+
+	return ioctl(fd, HELLOWORLD_IOCTL_INCREMENT, &inc);
+}
+
+int
+helloworld_add(int fd, long long count, long long *sum)
+{
+	helloworld_ioctl_add_t add = {
+		.count = count,
+		.flags = sum ? HELLOWORLD_ADD_SUM : 0,
+	};
+	int ret;
+
+	ret = ioctl(fd, HELLOWORLD_IOCTL_ADD, &add);
+	if (ret == 0 && sum)
+		*sum = add.sum;
+
+	return ret;
+}
@@ -0,0 +1,250 @@
+/*
+ * hwbench.c - Measure the helloworld device interfaces
+ *
+ * Every path is run with 1 up to --threads threads, each doing --ops
+ * operations on its own file descriptor. One CSV line is printed per
+ * path and thread count with the throughput and latency percentiles
+ * in nanoseconds.
+ *
+ * hwbench [--threads=N] [--ops=N] [--path=NAME]
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/helloworld.h>
+#include <helloworld_lib.h>
+
+struct bench_thread {
+	pthread_t thread;
+	pthread_barrier_t *start;
+	const struct bench_path *path;
+	int fd;
+	long ops;
+	unsigned long long *lat;   /* ns per operation */
+	unsigned long long begin, end;
+	int err;
+	char buf[4096];
+};
+
+struct bench_path {
+	const char *name;
+	const char *file;          /* opened by every thread */
+	int (*op)(struct bench_thread *t);
+};
+
+static int
+bench_ioctl_inc(struct bench_thread *t)
+{
+	return helloworld_inc(t->fd);
+}
+
+static int
+bench_ioctl_add(struct bench_thread *t)
+{
+	return helloworld_add(t->fd, 1, NULL);
+}
+
+static int
+bench_ioctl_add_sum(struct bench_thread *t)
+{
+	long long sum;
+
+	return helloworld_add(t->fd, 1, &sum);
+}
+
+/* One page of /proc/helloworld from the start */
+static int
+bench_proc_read(struct bench_thread *t)
+{
+	return pread(t->fd, t->buf, sizeof(t->buf), 0) < 0 ? -1 : 0;
+}
+
+static const struct bench_path bench_paths[] = {
+	{ "ioctl_inc",     HELLOWORLD_DEV_PATH,  bench_ioctl_inc },
+	{ "ioctl_add",     HELLOWORLD_DEV_PATH,  bench_ioctl_add },
+	{ "ioctl_add_sum", HELLOWORLD_DEV_PATH,  bench_ioctl_add_sum },
+	{ "proc_read",     HELLOWORLD_PROC_PATH, bench_proc_read },
+};
+
+#define BENCH_PATHS (sizeof(bench_paths) / sizeof(bench_paths[0]))
+
+static unsigned long long
+bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void *
+bench_thread_run(void *arg)
+{
+	struct bench_thread *t = arg;
+	unsigned long long before, after;
+	long i;
+
+	pthread_barrier_wait(t->start);
+
+	before = t->begin = bench_now();
+	for (i = 0; i < t->ops; i++) {
+		if (t->path->op(t) < 0) {
+			t->err = errno;
+			t->ops = i;
+			break;
+		}
+		after = bench_now();
+		t->lat[i] = after - before;
+		before = after;
+	}
+	t->end = bench_now();
+
+	return NULL;
+}
+
+static int
+bench_cmp(const void *a, const void *b)
+{
+	unsigned long long x = *(const unsigned long long *)a;
+	unsigned long long y = *(const unsigned long long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static unsigned long long
+bench_percentile(const unsigned long long *lat, long n, double p)
+{
+	return n ? lat[(long)(p * (n - 1))] : 0;
+}
+
+static int
+bench_run(const struct bench_path *path, int nthreads, long ops)
+{
+	struct bench_thread *threads;
+	pthread_barrier_t start;
+	unsigned long long *lat, begin, end, elapsed;
+	long total = 0;
+	int i, ret = 0;
+
+	threads = calloc(nthreads, sizeof(*threads));
+	lat = malloc(nthreads * ops * sizeof(*lat));
+	if (threads == NULL || lat == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	pthread_barrier_init(&start, NULL, nthreads + 1);
+
+	for (i = 0; i < nthreads; i++) {
+		threads[i].start = &start;
+		threads[i].path = path;
+		threads[i].ops = ops;
+		threads[i].lat = lat + i * ops;
+		threads[i].fd = open(path->file, O_RDWR);
+		if (threads[i].fd < 0)
+			threads[i].fd = open(path->file, O_RDONLY);
+		if (threads[i].fd < 0) {
+			fprintf(stderr, "%s: %s\n", path->file, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		pthread_create(&threads[i].thread, NULL, bench_thread_run,
+			       &threads[i]);
+	}
+
+	pthread_barrier_wait(&start);
+
+	/* From the first thread starting to the last one finishing */
+	begin = ~0ULL;
+	end = 0;
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(threads[i].thread, NULL);
+		if (threads[i].begin < begin)
+			begin = threads[i].begin;
+		if (threads[i].end > end)
+			end = threads[i].end;
+	}
+	elapsed = end - begin;
+
+	/* Pack the latencies of all threads together */
+	for (i = 0; i < nthreads; i++) {
+		memmove(lat + total, threads[i].lat,
+			threads[i].ops * sizeof(*lat));
+		total += threads[i].ops;
+		if (threads[i].err) {
+			fprintf(stderr, "%s: %s\n", path->name,
+				strerror(threads[i].err));
+			ret = -1;
+		}
+		close(threads[i].fd);
+	}
+	qsort(lat, total, sizeof(*lat), bench_cmp);
+
+	printf("helloworld,%s,%d,same,%ld,%.6f,%.0f,%llu,%llu,%llu,%llu,%llu\n",
+	       path->name, nthreads, total, elapsed / 1e9,
+	       elapsed ? total * 1e9 / elapsed : 0.0,
+	       bench_percentile(lat, total, 0.50),
+	       bench_percentile(lat, total, 0.90),
+	       bench_percentile(lat, total, 0.99),
+	       bench_percentile(lat, total, 0.999),
+	       total ? lat[total - 1] : 0);
+	fflush(stdout);
+
+	pthread_barrier_destroy(&start);
+	free(lat);
+	free(threads);
+	return ret;
+}
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [--threads=N] [--ops=N] [--path=NAME]\n"
+		"paths:", prog);
+	for (size_t i = 0; i < BENCH_PATHS; i++)
+		fprintf(stderr, " %s", bench_paths[i].name);
+	fprintf(stderr, "\n");
+	exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *only = NULL;
+	int nthreads = 1, t, i, ret = 0;
+	long ops = 100000;
+	size_t p;
+
+	for (i = 1; i < argc; i++) {
+		if (strncmp(argv[i], "--threads=", 10) == 0)
+			nthreads = atoi(argv[i] + 10);
+		else if (strncmp(argv[i], "--ops=", 6) == 0)
+			ops = atol(argv[i] + 6);
+		else if (strncmp(argv[i], "--path=", 7) == 0)
+			only = argv[i] + 7;
+		else
+			usage(argv[0]);
+	}
+	if (nthreads < 1 || ops < 1)
+		usage(argv[0]);
+
+	printf("module,path,threads,devices,ops,seconds,ops_per_sec,"
+	       "p50_ns,p90_ns,p99_ns,p999_ns,max_ns\n");
+
+	for (p = 0; p < BENCH_PATHS; p++) {
+		if (only && strcmp(only, bench_paths[p].name) != 0)
+			continue;
+		for (t = 1; t <= nthreads; t++)
+			if (bench_run(&bench_paths[p], t, ops) < 0)
+				ret = EXIT_FAILURE;
+	}
+
+	return ret;
+}
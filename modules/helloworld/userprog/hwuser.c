@@ -0,0 +1,56 @@
+/*
+ * hwuser.c - Increment the helloworld message count
+ *
+ * hwuser --inc=N   adds N messages with one ioctl each
+ * hwuser --add=N   adds N messages with a single ioctl and prints
+ *                  the new total
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <linux/helloworld.h>
+#include <helloworld_lib.h>
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s --inc=N | --add=N\n", prog);
+	exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char **argv)
+{
+	long long count, sum;
+	int fd, i, ret = 0;
+
+	if (argc != 2)
+		usage(argv[0]);
+
+	fd = helloworld_open();
+	if (fd < 0) {
+		perror(HELLOWORLD_DEV_PATH);
+		return EXIT_FAILURE;
+	}
+
+	if (strncmp(argv[1], "--inc=", 6) == 0) {
+		count = atoll(argv[1] + 6);
+		for (i = 0; i < count && ret == 0; i++)
+			ret = helloworld_inc(fd);
+	} else if (strncmp(argv[1], "--add=", 6) == 0) {
+		count = atoll(argv[1] + 6);
+		ret = helloworld_add(fd, count, &sum);
+		if (ret == 0)
+			printf("%lld\n", sum);
+	} else {
+		usage(argv[0]);
+	}
+
+	if (ret < 0)
+		fprintf(stderr, "ioctl: %s\n", strerror(errno));
+
+	helloworld_close(fd);
+	return ret < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
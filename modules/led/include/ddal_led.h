@@ -3,9 +3,23 @@
 
 #define DDAL_LED_MAGIC 0xd34db33f
 
-extern int ddal_led_open(void);
+/*
+ * Userspace interface to the LEDs of the led kmod, a thin wrapper
+ * around the C++ interface in ddal_led.hpp. A LED is opened by
+ * its index, the N of /dev/ledN. All functions return 0, or a file
+ * descriptor for ddal_led_open(), on success and -1 with errno set
+ * on failure.
+ */
+#define DDAL_LED_DEV_PATH  "/dev/led"
+#define DDAL_LED_PROC_PATH "/proc/led"
 
-extern int ddal_led_close(void);
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern int ddal_led_open(unsigned int index);
+
+extern int ddal_led_close(int fd);
 
 extern int ddal_led_on(int fd);
 
@@ -13,4 +27,14 @@ extern int ddal_led_off(int fd);
 
 extern int ddal_led_toggle(int fd);
 
+/* brightness is 0-255 */
+extern int ddal_led_set_brightness(int fd, unsigned int brightness);
+
+/* Returns the brightness, or -1 */
+extern int ddal_led_get_brightness(int fd);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif
@@ -0,0 +1,176 @@
+#ifndef DDAL_LED_HPP
+#define DDAL_LED_HPP
+
+/*
+ * C++ interface to the LEDs of the led kmod. ddal_led.h is a thin C
+ * wrapper around this.
+ *
+ * Errors are reported by throwing std::system_error with the errno
+ * of the failing call, or std::out_of_range for bad arguments.
+ */
+#include <array>
+#include <cstddef>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+#include <linux/led.h>
+
+namespace ddal {
+
+/*
+ * Index of a LED, the N of /dev/ledN. The range is checked when the
+ * id is made, at compile time for constants:
+ *
+ *     constexpr ddal::led_id status{3};
+ *     auto status = ddal::led_id::of<3>();
+ */
+class led_id {
+public:
+	constexpr explicit led_id(unsigned int index)
+		: index_(index < LED_MAX ? index :
+			 throw std::out_of_range("LED index out of range")) {}
+
+	template <unsigned int Index>
+	static constexpr led_id of()
+	{
+		static_assert(Index < LED_MAX, "LED index out of range");
+		return led_id(Index);
+	}
+
+	constexpr unsigned int index() const { return index_; }
+
+	constexpr bool operator==(led_id other) const
+	{
+		return index_ == other.index_;
+	}
+
+	constexpr bool operator!=(led_id other) const
+	{
+		return index_ != other.index_;
+	}
+
+private:
+	unsigned int index_;
+};
+
+/*
+ * System calls on an open /dev/ledN, shared by led and the C
+ * interface. All throw std::system_error on failure.
+ */
+namespace sys {
+
+int open(led_id id);
+void close(int fd);
+void ioctl(int fd, unsigned long request, void *arg = nullptr);
+void apply(int fd, const led_cmd_t &cmd);
+void batch(int fd, const led_cmd_t *cmds, std::size_t count);
+void set_brightness(int fd, unsigned int brightness);
+unsigned int get_brightness(int fd);
+
+} // namespace sys
+
+/*
+ * An open /dev/ledN. Move-only: the file descriptor is closed by the
+ * last owner.
+ */
+class led {
+public:
+	explicit led(led_id id);
+	~led();
+
+	led(led &&other) noexcept;
+	led &operator=(led &&other) noexcept;
+
+	led(const led &) = delete;
+	led &operator=(const led &) = delete;
+
+	led_id id() const { return id_; }
+	int fd() const { return fd_; }
+
+	/* Give up ownership of the descriptor, the caller closes it */
+	int release() noexcept;
+
+	void on();
+	void off();
+	void toggle();
+	void brightness(unsigned int value);
+	unsigned int brightness() const;
+	void engine(unsigned int engine);
+	led_ioctl_engine_t engine_info() const;
+	void apply(const led_cmd_t &cmd);
+
+	/*
+	 * State of all LEDs, not just this one, in index order. See
+	 * LED_IOCTL_SNAPSHOT for what consistent means.
+	 */
+	std::vector<led_state_t> snapshot(bool *consistent = nullptr) const;
+
+private:
+	led_id id_;
+	int fd_;
+};
+
+/*
+ * Keeps one led per index open once it was asked for, so repeated
+ * access does not pay for open() and close() again.
+ */
+class led_cache {
+public:
+	led &get(led_id id);
+	void close(led_id id);
+	void clear();
+
+	/* Any open LED, or nullptr */
+	led *any();
+
+private:
+	std::array<std::unique_ptr<led>, LED_MAX> leds_;
+};
+
+/*
+ * Collects commands for any number of LEDs and sends them with
+ * commit() in as few calls as the module allows: one LED_IOCTL_BATCH
+ * per LED_BATCH_MAX commands. Up to that size the whole transaction
+ * takes effect together as LED_IOCTL_BATCH describes, larger ones are
+ * applied in LED_BATCH_MAX chunks.
+ *
+ * A brightness, on or off for a LED replaces an earlier brightness
+ * change of the same LED in the transaction, and a toggle following
+ * one is folded into it, so commands that are overwritten before
+ * commit() never reach the kernel. A toggle following a toggle is
+ * sent as is. A transaction that is destroyed
+ * without commit() changes nothing.
+ */
+class transaction {
+public:
+	explicit transaction(led_cache &cache);
+
+	transaction &on(led_id id);
+	transaction &off(led_id id);
+	transaction &toggle(led_id id);
+	transaction &brightness(led_id id, unsigned int value);
+	transaction &engine(led_id id, unsigned int engine);
+	transaction &dither(led_id id, bool enable);
+	transaction &relaxed(led_id id, bool enable);
+
+	/* Commands to send, after folding */
+	std::size_t size() const { return cmds_.size(); }
+	const std::vector<led_cmd_t> &commands() const { return cmds_; }
+
+	void commit();
+	void clear();
+
+private:
+	static constexpr int none = -1;
+
+	transaction &add(led_id id, unsigned int op, unsigned int value);
+
+	led_cache &cache_;
+	std::vector<led_cmd_t> cmds_;
+	std::array<int, LED_MAX> level_;  /* slot of the brightness of a LED */
+};
+
+} // namespace ddal
+
+#endif /* DDAL_LED_HPP */
@@ -1,6 +1,9 @@
 #ifndef LED_KM_H
 #define LED_KM_H
 
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
 /* 
  * ===============================================
  *             DDAL LED Data Structures
@@ -33,7 +36,42 @@ extern struct proc_dir_entry *led_proc_entry;
  * ===============================================
  */
 
-#define LED_COUNT 3
+/*
+ * Upper bound on the number of LED instances, and so on the minor of
+ * /dev/ledN. Instances are created at load time from the gpiopins
+ * module parameter and at runtime through configfs.
+ */
+#define LED_MAX 256
+
+/*
+ * PWM engines a LED can be driven by. The engine is selected per
+ * device with LED_IOCTL_SET_ENGINE.
+ *
+ * LED_ENGINE_TIMER   - jiffies based timer_list, one timer per LED
+ * LED_ENGINE_HRTIMER - high resolution timer, edges placed with
+ *                      sub-millisecond accuracy and 8-bit duty
+ *                      resolution
+ * LED_ENGINE_SHARED  - one high resolution timer for all LEDs on this
+ *                      engine, pins written together in one call
+ * LED_ENGINE_BCM     - binary code modulation, one high resolution
+ *                      timer for all LEDs on this engine stepping
+ *                      through a fixed schedule of bit planes
+ * LED_ENGINE_KTHREAD - the hrtimer engine schedule run from a
+ *                      SCHED_FIFO kernel thread instead of timer
+ *                      interrupts, which can be pinned to a CPU
+ *                      with the kthread_cpu module parameter
+ *
+ * A LED bound to a hardware PWM channel (the pwms module parameter or
+ * the pwm configfs attribute) is driven by the PWM controller whatever
+ * engine is selected, LED_IOCTL_GET_ENGINE then reports the timing of
+ * the channel.
+ */
+#define LED_ENGINE_TIMER     0
+#define LED_ENGINE_HRTIMER   1
+#define LED_ENGINE_SHARED    2
+#define LED_ENGINE_BCM       3
+#define LED_ENGINE_KTHREAD   4
+#define LED_ENGINE_COUNT     5
 
 
 /*
@@ -44,6 +82,229 @@ typedef struct led_ioctl_inc_s {
 	int placeholder;
 } led_ioctl_inc_t;
 
+/*
+ * Engine selection and the timing the engine actually achieves for
+ * the current brightness. Only the engine member is used by
+ * LED_IOCTL_SET_ENGINE, the rest is filled in by LED_IOCTL_GET_ENGINE
+ * so the accuracy of the engines can be compared from userspace.
+ */
+typedef struct led_ioctl_engine_s {
+	unsigned int engine;
+	unsigned int period_ns;      /* achieved PWM period */
+	unsigned int on_ns;          /* achieved on time within a period */
+	unsigned int resolution_ns;  /* granularity an edge can be placed with */
+	unsigned int steps;          /* distinct duty cycles per period */
+} led_ioctl_engine_t;
+
+/*
+ * A single command for one LED. The same record is used wherever
+ * several commands travel together, e.g. LED_IOCTL_BATCH.
+ * LED_IOCTL_CMD applies one to the LED of the file, its led member is
+ * ignored.
+ */
+#define LED_OP_BRIGHTNESS    0    /* value is the brightness, 0-255 */
+#define LED_OP_ON            1
+#define LED_OP_OFF           2
+#define LED_OP_TOGGLE        3
+#define LED_OP_ENGINE        4    /* value is one of LED_ENGINE_* */
+#define LED_OP_DITHER        5    /* value 1 dithers the timer engine */
+#define LED_OP_PRECISION     6    /* value is one of LED_PRECISION_* */
+
+/*
+ * How exactly the edges of a LED are placed.
+ *
+ * LED_PRECISION_EXACT   - every edge wakes the CPU on time, the default
+ * LED_PRECISION_RELAXED - edges may come up to the relaxed_slack_us
+ *                         module parameter late, so they can ride
+ *                         along with other wakeups of an idle CPU. For
+ *                         slow blinks and status LEDs where the error
+ *                         does not show. The timer engine uses
+ *                         deferrable timers with an ordinary one at
+ *                         the slack as a backstop, the hrtimer and
+ *                         kthread engines timer slack, the shared and
+ *                         bcm engines stay exact. Wakeups saved are
+ *                         shown in /proc/led.
+ */
+#define LED_PRECISION_EXACT    0
+#define LED_PRECISION_RELAXED  1
+
+typedef struct led_cmd_s {
+	__u16 led;           /* LED index, the minor of /dev/ledN */
+	__u8  op;            /* one of LED_OP_* */
+	__u8  reserved;
+	__u32 value;
+} led_cmd_t;
+
+/*
+ * Applies count commands in one call. Commands are applied in array
+ * order and the LEDs involved start their new configuration together:
+ * on the timer, hrtimer and kthread engines with a period that starts
+ * on a common edge shortly after the call, the timer engine on the
+ * tick at or after it, on the shared and bcm engines with the next
+ * period of their timer. LEDs on a hardware PWM channel change as
+ * their channel is programmed. Nothing is changed if any command is
+ * invalid or has a non-zero reserved field.
+ */
+#define LED_BATCH_MAX        256
+
+typedef struct led_ioctl_batch_s {
+	__u64 cmds;          /* user pointer to an array of led_cmd_t */
+	__u32 count;
+	__u32 reserved;
+} led_ioctl_batch_t;
+
+/*
+ * Format of the data written to /dev/ledN, selected per open file.
+ *
+ * LED_FORMAT_TEXT   - one ASCII brightness per write(), the default
+ * LED_FORMAT_BINARY - a stream of led_cmd_t records. Every complete
+ *                     record is consumed in order, a trailing partial
+ *                     record is left unconsumed. The led member is
+ *                     ignored, records always apply to the LED the
+ *                     file was opened for. Records from one write()
+ *                     or writev() reach the pin together.
+ */
+#define LED_FORMAT_TEXT      0
+#define LED_FORMAT_BINARY    1
+
+/*
+ * Writes to a /dev/ledN opened with O_NONBLOCK never sleep. Their
+ * commands are checked and queued, and the write returns at once with
+ * what fit into the queue, or fails with EAGAIN if nothing did. The
+ * queue is applied shortly after, in order, with everything queued
+ * until then folded into one change so only the latest brightness
+ * reaches the pin. POLLOUT signals room in the queue. The queued,
+ * coalesced and dropped counters of the LED in debugfs show how the
+ * queue is doing, and its queue file how full it is now and at most.
+ */
+#define LED_QUEUE_MAX        64
+
+typedef struct led_ioctl_format_s {
+	unsigned int format;
+} led_ioctl_format_t;
+
+/*
+ * A pattern is a list of keyframes played back by the module itself.
+ * Each keyframe sets the brightness and holds it for duration_ms, or
+ * with LED_PATTERN_INTERPOLATE ramps linearly towards the brightness
+ * of the following keyframe within that time. The list is played
+ * repeat times, 0 repeats forever. Uploading a pattern with no
+ * keyframes stops playback, and so does any direct brightness change.
+ * Unknown flags and non-zero reserved fields fail with EINVAL.
+ */
+#define LED_PATTERN_MAX           256
+#define LED_PATTERN_INTERPOLATE   0x1
+
+typedef struct led_keyframe_s {
+	__u8  brightness;
+	__u8  reserved[3];
+	__u32 duration_ms;   /* at least 1 */
+} led_keyframe_t;
+
+typedef struct led_ioctl_pattern_s {
+	__u64 keyframes;     /* user pointer to an array of led_keyframe_t */
+	__u32 count;
+	__u32 repeat;
+	__u32 flags;         /* LED_PATTERN_* */
+	__u32 reserved;
+} led_ioctl_pattern_t;
+
+/*
+ * The brightness curve maps each brightness level to the duty cycle
+ * the LEDs run, 0 is off and 65535 always on. It is the same for all
+ * LEDs. The module starts with a curve chosen at build time, gamma
+ * 2.2 unless built otherwise. LED_IOCTL_SET_CURVE replaces it with
+ * LED_CURVE_SIZE duty cycles, or with duty 0 restores the built-in
+ * one. Every LED picks up the new curve at its next PWM period.
+ */
+#define LED_CURVE_SIZE       256
+
+typedef struct led_ioctl_curve_s {
+	__u64 duty;          /* user pointer to LED_CURVE_SIZE __u16, or 0 */
+	__u32 reserved[2];
+} led_ioctl_curve_t;
+
+/*
+ * LED_IOCTL_SNAPSHOT fills in the state of every LED, in index order,
+ * with one call on any /dev/ledN. engine, brightness and generation
+ * are those of the published configuration, applied_engine, applied,
+ * applied_generation and the timing those of the configuration the
+ * engine runs, which lags behind the published one until the engine
+ * picks it up at its next period. LED_STATE_PENDING is set while it
+ * does. Both are taken together, so LED_SNAPSHOT_CONSISTENT is set
+ * when they all held at one moment, time_ns.
+ *
+ * The pattern position and the counters are read alongside but not
+ * checked. A pattern moving on to a keyframe of the same brightness
+ * does not bump generation, so pattern_frame is not covered by
+ * LED_SNAPSHOT_CONSISTENT. total is the number of LEDs, at most
+ * filled of them are copied to states.
+ */
+#define LED_STATE_PATTERN    0x1  /* pattern_frame and pattern_repeat are valid */
+#define LED_STATE_DITHER     0x2
+#define LED_STATE_RELAXED    0x4  /* LED_PRECISION_RELAXED */
+#define LED_STATE_PWM        0x8  /* driven by a hardware PWM channel */
+#define LED_STATE_PENDING    0x10 /* generation is not applied yet */
+
+typedef struct led_state_s {
+	__u16 led;           /* LED index, the minor of /dev/ledN */
+	__u8  engine;        /* one of LED_ENGINE_* */
+	__u8  brightness;
+	__u32 flags;         /* LED_STATE_* */
+	__u32 generation;    /* bumped on every configuration change */
+	__u32 applied_generation;
+	__u32 period_ns;     /* applied, as LED_IOCTL_GET_ENGINE */
+	__u32 on_ns;
+	__u16 pattern_frame; /* keyframe playing */
+	__u16 pattern_repeat;/* plays left including this one, 0 = forever */
+	__u8  applied;       /* brightness the engine runs */
+	__u8  applied_engine;
+	__u8  reserved[2];
+	__u64 edges;         /* pin changes */
+	__u64 missed;        /* periods skipped to catch up */
+	__u64 changes;       /* configurations applied */
+} led_state_t;
+
+#define LED_SNAPSHOT_CONSISTENT   0x1
+
+typedef struct led_ioctl_snapshot_s {
+	__u64 states;        /* user pointer to count led_state_t */
+	__u32 count;
+	__u32 filled;        /* written by the module */
+	__u32 total;         /* written by the module */
+	__u32 flags;         /* written by the module, LED_SNAPSHOT_* */
+	__u64 time_ns;       /* written by the module, CLOCK_MONOTONIC */
+} led_ioctl_snapshot_t;
+
+/*
+ * Layout of the page every /dev/ledN can be mmap()ed with MAP_SHARED.
+ * The page is the same for all devices and has one entry per LED,
+ * indexed by the minor number.
+ *
+ * To change brightness without a syscall, store the new values to
+ * led[i].target and then increment generation with release
+ * semantics. The engines look at generation at the start of every PWM
+ * period and pick up the targets of their LED. applied and engine
+ * always show what the engine currently runs, applied_generation the
+ * last generation an engine has picked up.
+ */
+#define LED_SHM_SIZE         4096
+
+typedef struct led_shm_led_s {
+	__u8  target;        /* written by userspace */
+	__u8  applied;       /* written by the module */
+	__u8  engine;        /* written by the module */
+	__u8  reserved;
+} led_shm_led_t;
+
+typedef struct led_shm_s {
+	__u32 generation;          /* written by userspace */
+	__u32 applied_generation;  /* written by the module */
+	__u32 count;               /* number of entries in led[] */
+	__u32 reserved;
+	led_shm_led_t led[];
+} led_shm_t;
+
 /* 
  * This generic union allows us to make a more generic IOCTRL call
  * interface. Each per-IOCTL-flavor struct should be a member of this
@@ -51,11 +312,43 @@ typedef struct led_ioctl_inc_s {
  */
 typedef union led_ioctl_param_u {
 	led_ioctl_inc_t      set;
+	led_ioctl_engine_t   engine;
+	led_ioctl_batch_t    batch;
+	led_ioctl_pattern_t  pattern;
+	led_ioctl_format_t   format;
+	led_cmd_t            cmd;
+	led_ioctl_curve_t    curve;
+	led_ioctl_snapshot_t snapshot;
 } led_ioctl_param_union;
 
-#define LED_ON     1
-#define LED_OFF    2
-#define LED_TOGGLE 3
+/* 
+ * Used by _IO/_IOW/_IOR to create the unique IOCTL call numbers.
+ */
+#define LED_MAGIC 'l'
+
+#define LED_ON                 _IO(LED_MAGIC, 1)
+#define LED_OFF                _IO(LED_MAGIC, 2)
+#define LED_TOGGLE             _IO(LED_MAGIC, 3)
+#define LED_IOCTL_SET_ENGINE   _IOW(LED_MAGIC, 4, led_ioctl_engine_t)
+#define LED_IOCTL_GET_ENGINE   _IOR(LED_MAGIC, 5, led_ioctl_engine_t)
+#define LED_IOCTL_BATCH        _IOW(LED_MAGIC, 6, led_ioctl_batch_t)
+#define LED_IOCTL_SET_PATTERN  _IOW(LED_MAGIC, 7, led_ioctl_pattern_t)
+#define LED_IOCTL_SET_FORMAT   _IOW(LED_MAGIC, 8, led_ioctl_format_t)
+#define LED_IOCTL_CMD          _IOW(LED_MAGIC, 9, led_cmd_t)
+#define LED_IOCTL_SET_CURVE    _IOW(LED_MAGIC, 10, led_ioctl_curve_t)
+#define LED_IOCTL_SNAPSHOT     _IOWR(LED_MAGIC, 11, led_ioctl_snapshot_t)
+
+/*
+ * The ioctls that only pass data in can also be queued through
+ * io_uring, from kernel 5.19 on: an IORING_OP_URING_CMD SQE on the fd
+ * of /dev/ledN with cmd_op set to the ioctl number and the argument
+ * struct copied into the SQE command area. The result is the res of
+ * the completion. Arguments of up to 16 bytes fit every SQE, so
+ * LED_IOCTL_CMD and LED_IOCTL_BATCH always work. LED_IOCTL_SET_PATTERN
+ * needs a ring set up with IORING_SETUP_SQE128. Memory the argument
+ * points to, like the keyframes of a pattern or the commands of a
+ * batch, must stay valid until the command completes.
+ */
 
 
 #endif /* LED_KM_H */
@@ -4,8 +4,9 @@
  */
 #include <linux/kernel.h>   /* printk() */
 #include <linux/slab.h>     /* kmalloc() */
-#include <asm/uaccess.h>    /* copy_*_user */
-#include <linux/semaphore.h>
+#include <linux/uaccess.h>  /* copy_*_user */
+#include <linux/mutex.h>
+#include <linux/seqlock.h>
 #include <linux/fs.h>
 #include <linux/miscdevice.h>
 #include <linux/module.h>
@@ -15,340 +16,3903 @@
 #include <linux/gpio.h>
 #include <linux/sched.h>
 #include <linux/cdev.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/spinlock.h>
+#include <linux/gpio/consumer.h>
+#include <linux/mm.h>
+#include <linux/uio.h>
+#include <linux/idr.h>
+#include <linux/kref.h>
+#include <linux/list_sort.h>
+#include <linux/device.h>
+#include <linux/configfs.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/percpu.h>
+#include <linux/log2.h>
+#include <linux/wait.h>
+#include <linux/vmalloc.h>
+#include <linux/pwm.h>
+#include <linux/leds.h>
+#include <linux/workqueue.h>
+#include <linux/rcupdate.h>
+#include <linux/poll.h>
+#include <linux/kfifo.h>
+#include <linux/kthread.h>
+#include <linux/cpumask.h>
+#include <linux/version.h>
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,9,0)
+#include <linux/sched/types.h>  /* struct sched_param */
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,7,0)
+#include <linux/io_uring/cmd.h>
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5,19,0)
+#include <linux/io_uring.h>
+#endif
+
+/*
+ * Interfaces renamed or replaced since 4.19, used under their current
+ * names. The ones that changed shape are picked where they are used.
+ */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,2,0)
+#define timer_delete            del_timer
+#define timer_delete_sync       del_timer_sync
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,16,0)
+#define timer_container_of      from_timer
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,8,0)
+#define pwm_apply_might_sleep   pwm_apply_state
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,13,0)
+static inline void hrtimer_setup(struct hrtimer *timer,
+                                 enum hrtimer_restart (*function)(struct hrtimer *),
+                                 clockid_t clock_id, enum hrtimer_mode mode)
+{
+    hrtimer_init(timer, clock_id, mode);
+    timer->function = function;
+}
+#endif
 
 #include "../include/linux/led.h"
 
+#define CREATE_TRACE_POINTS
+#include "led_trace.h"
+
+/* led_curve_builtin[], generated from led_gamma.awk */
+#include "led_gamma.h"
+
+
+#define MODULE_LICENSE_STR      "GPL"
+#define MODULE_DESCRIPTION_STR  "Simple LED module example with procfs and IOCTL"
+#define MODULE_AUTHOR_STR       "Darije Hanzekovic <darije.hanzekovic@gmail.com>"
+#define MODULE_VERSION_STR      "0.1"
+
+
+#define BUFFER_SIZE    64
+#define RECORD_CHUNK   32      /* led_cmd_t records copied in at once */
+#define LED_PINS_CHUNK 32      /* pins written with one call */
+#define LED_HIST_BUCKETS 32    /* log2 buckets, the last one open ended */
+#define LED_SNAPSHOT_TRIES 4   /* collects before giving up on consistency */
+#define LED_BATCH_LEAD_US  500 /* common edge of a batch after the ioctl */
+
+#define PWM_PERIOD  25      /* in milliseconds */
+#define PWM_RES     4       /* in bits */
+#define LED_DUTY_SHIFT 16
+#define LED_DUTY_ONE   (1 << LED_DUTY_SHIFT)   /* duty cycle of always on */
+
+/*
+ * Required Proc File-system Struct
+ *
+ * Used to map entry into proc file table upon module insertion
+ */
+static ssize_t led_proc_read(struct file *file,
+        char __user *buffer,
+        size_t buffer_length, loff_t * offset_ptr);
+
+struct proc_dir_entry *led_proc_entry;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,6,0)
+static const struct proc_ops proc_file_fops = {
+    .proc_read = led_proc_read,
+};
+#else
+static const struct file_operations proc_file_fops = {
+    .owner = THIS_MODULE,
+    .read = led_proc_read,
+};
+#endif
+
+/*
+ * A pattern being played back, see LED_IOCTL_SET_PATTERN. Only
+ * allocated while a pattern is set.
+ */
+struct led_pattern {
+    unsigned int count;
+    unsigned int repeat;        /* plays left including this one, 0 = forever */
+    unsigned int flags;
+    unsigned int frame;         /* keyframe currently playing */
+    ktime_t frame_start;
+    led_keyframe_t frames[];
+};
+
+/*
+ * The PWM configuration of a LED. Writers build a complete new one
+ * and publish it with led_config_publish(), the engines and readers
+ * take consistent snapshots with led_config_read() without ever
+ * blocking on a writer.
+ */
+struct led_config {
+    u32 generation;             /* bumped on every publish */
+    unsigned int brightness;
+    unsigned int engine;
+    unsigned int msec_on;       /* LED_ENGINE_TIMER */
+    unsigned int msec_off;
+    unsigned int dither;        /* LED_ENGINE_TIMER, see led_timer_dither() */
+    unsigned int relaxed;       /* LED_OP_PRECISION, see led_slack_ns() */
+    u64 nsec_on;                /* all high resolution engines */
+    u64 nsec_off;
+    unsigned int code;          /* LED_ENGINE_BCM, brightness in bcm_bits */
+    u32 duty;                   /* of LED_DUTY_ONE, from the brightness curve */
+};
+
+/*
+ * Per-CPU statistics of a LED, or of the timer the shared and bcm
+ * engines run for all their LEDs. Histogram bucket 0 counts zero,
+ * bucket n values in [2^(n-1), 2^n) nanoseconds. Exposed in debugfs,
+ * see led_stats_debugfs().
+ */
+struct led_stats {
+    u64 lateness[LED_HIST_BUCKETS];   /* timer expiry to callback */
+    u64 cost[LED_HIST_BUCKETS];       /* time spent in the callback */
+    u64 edges;                        /* pin changes */
+    u64 missed;                       /* periods skipped to catch up */
+    u64 changes;                      /* configurations applied */
+    u64 saved;                        /* wakeups avoided, see led_stats_saved() */
+    u64 queued;                       /* commands queued by O_NONBLOCK writes */
+    u64 coalesced;                    /* queued commands folded into later ones */
+    u64 dropped;                      /* commands refused, the queue was full */
+};
+
+/*
+ * A LED instance. Instances come and go at runtime, see
+ * led_create() and led_destroy(), and are found by their index, the
+ * minor of /dev/ledN, in led_idr. Open files hold a reference.
+ */
+struct led_dev {
+    struct kref ref;
+    unsigned int index;
+    char *name;
+    unsigned int gpiopin;
+    struct gpio_desc *desc;
+    struct pwm_device *pwm;     /* hardware PWM channel, or NULL */
+    int dead;                   /* destroyed, under lock */
+    seqlock_t cfg_lock;
+    struct led_config cfg;      /* published configuration */
+    struct led_config run;      /* snapshot the engine runs this period */
+    seqcount_t run_seq;         /* for readers of run outside the engine */
+    int running;                /* engine timer armed, under cfg_lock */
+    int pinval;                 /* last value written to the pin */
+    int period_edge;            /* next expiry starts a period */
+    unsigned long timer_off;    /* jiffies the current period stays off */
+    ktime_t timer_due;          /* tick the timer_list timer expires on */
+    ktime_t kthread_due;        /* next edge on the kthread engine */
+    unsigned int dither_err;    /* rounding error carried to the next period */
+    u32 shm_generation;         /* last led_shm generation seen */
+    struct led_pattern *pattern;
+    int pattern_frame;          /* keyframe playing, -1 for none, see led_pattern_publish() */
+    unsigned int pattern_repeat;
+    struct timer_list timer;
+    struct timer_list timer_backstop;   /* relaxed LEDs, see led_timer_expired() */
+    spinlock_t timer_lock;      /* one of the two timers runs an edge */
+    int timer_armed;            /* the edge at timer.expires is still to run */
+    struct hrtimer hrtimer;
+    struct delayed_work pwm_work;   /* see led_pwm_work() */
+    struct led_classdev cdev;   /* /sys/class/leds/ledN */
+    char cdev_name[16];
+    struct list_head engine_node;   /* on led_shared, led_bcm or led_kthread */
+    struct mutex lock;          /* serializes writers */
+    struct led_stats __percpu *stats;
+    struct dentry *debugfs;
+    wait_queue_head_t wait;     /* pollers, woken by led_notify() */
+    atomic_t events;            /* bumped on every state change */
+    spinlock_t queue_lock;      /* serializes producers of queue */
+    DECLARE_KFIFO(queue, led_cmd_t, LED_QUEUE_MAX);
+    unsigned int queue_peak;    /* most commands queued at once, under queue_lock */
+    struct work_struct queue_work;  /* see led_queue_work() */
+};
+
+static DEFINE_IDR(led_idr);
+static DEFINE_MUTEX(led_idr_lock);
+
+static struct cdev led_cdev;  /* Char device structure, all minors */
+static struct class *led_class;
+static struct workqueue_struct *led_queue_wq;
+
+/*
+ * Per open file state.
+ */
+struct led_file {
+    struct led_dev *dev;
+    unsigned int format;        /* LED_FORMAT_* */
+    int seen;                   /* dev->events at the last read */
+};
+
+static dev_t firstdev;
+
+static unsigned int gpiopins[LED_MAX] = { 2, 3, 4 };
+static unsigned int ngpiopins = 3;
+module_param_array(gpiopins, uint, &ngpiopins, S_IRUGO);
+MODULE_PARM_DESC(gpiopins, "A list of GPIO pins LEDs are attached to at load time");
+
+static unsigned int default_engine = LED_ENGINE_TIMER;
+module_param(default_engine, uint, S_IRUGO);
+MODULE_PARM_DESC(default_engine, "PWM engine LEDs start with (0=timer, 1=hrtimer, 2=shared, 3=bcm, 4=kthread)");
+
+static int pwms[LED_MAX] = { [0 ... LED_MAX - 1] = -1 };
+static unsigned int npwms;
+module_param_array(pwms, int, &npwms, S_IRUGO);
+MODULE_PARM_DESC(pwms, "PWM channels of the LEDs given in gpiopins, -1 for none. A LED with a channel is driven by it instead of its GPIO");
+
+static unsigned int pwm_period_ns = 1000000;
+module_param(pwm_period_ns, uint, S_IRUGO);
+MODULE_PARM_DESC(pwm_period_ns, "PWM period of LEDs driven by a PWM channel in nanoseconds");
+
+static char *triggers[LED_MAX];
+static unsigned int ntriggers;
+module_param_array(triggers, charp, &ntriggers, S_IRUGO);
+MODULE_PARM_DESC(triggers, "Default LED triggers of the LEDs given in gpiopins, e.g. heartbeat,disk-activity");
+
+static bool timer_dither;
+module_param(timer_dither, bool, S_IRUGO);
+MODULE_PARM_DESC(timer_dither, "Dither the timer engine by default, see LED_OP_DITHER");
+
+static bool relaxed;
+module_param(relaxed, bool, S_IRUGO);
+MODULE_PARM_DESC(relaxed, "LEDs start with relaxed precision, see LED_OP_PRECISION");
+
+static unsigned int relaxed_slack_us = 20000;
+module_param(relaxed_slack_us, uint, S_IRUGO);
+MODULE_PARM_DESC(relaxed_slack_us, "How late an edge of a relaxed LED may come in microseconds");
+
+static unsigned int hrperiod_us = PWM_PERIOD * USEC_PER_MSEC;
+module_param(hrperiod_us, uint, S_IRUGO);
+MODULE_PARM_DESC(hrperiod_us, "PWM period of the hrtimer engine in microseconds");
+
+static unsigned int shared_steps = 32;
+module_param(shared_steps, uint, S_IRUGO);
+MODULE_PARM_DESC(shared_steps, "Duty cycle steps per period of the shared engine");
+
+static unsigned int bcm_bits = PWM_RES;
+module_param(bcm_bits, uint, S_IRUGO);
+MODULE_PARM_DESC(bcm_bits, "Bit depth of the bcm engine (1-8)");
+
+/*
+ * A PWM engine turns the brightness of a configuration into edge
+ * times (config) and drives the pin of a device from its run
+ * snapshot (run/stop). run starts a new period at edge, which lets
+ * several LEDs share their first edge. info reports the timing the
+ * engine really achieves for a configuration.
+ */
+/*
+ * What an engine runs for one duty cycle: on and off time in its own
+ * units, and for the bcm engine the code.
+ */
+struct led_duty {
+    u64 on;
+    u64 off;
+    unsigned int code;
+};
+
+struct led_engine_ops {
+    const char *name;
+    void (*curve)(u32 duty, struct led_duty *out);
+    void (*config)(struct led_config *cfg);
+    void (*run)(struct led_dev *dev, ktime_t edge);
+    void (*stop)(struct led_dev *dev);
+    void (*info)(const struct led_config *cfg, led_ioctl_engine_t *info);
+};
+
+static const struct led_engine_ops led_engines[LED_ENGINE_COUNT];
+static void led_config_commit(struct led_dev *dev, struct led_config *cfg,
+                              int stop_pattern);
+
+static unsigned int led_hist_bucket(s64 ns)
+{
+    if (ns <= 0)
+        return 0;
+
+    return min_t(unsigned int, ilog2(ns) + 1, LED_HIST_BUCKETS - 1);
+}
+
+/* A timer due at scheduled runs its callback from now on */
+static void led_stats_fired(struct led_stats __percpu *stats,
+                            ktime_t scheduled, ktime_t now)
+{
+    this_cpu_inc(stats->lateness[led_hist_bucket(
+                     ktime_to_ns(ktime_sub(now, scheduled)))]);
+}
+
+/* The callback started at start is done */
+static void led_stats_done(struct led_stats __percpu *stats, ktime_t start)
+{
+    this_cpu_inc(stats->cost[led_hist_bucket(
+                     ktime_to_ns(ktime_sub(ktime_get(), start)))]);
+}
+
+/* Wakeups saved by all LEDs since load, for /proc/led */
+static DEFINE_PER_CPU(u64, led_saved);
+static ktime_t led_loaded;
+
+/*
+ * n wakeups an exact LED would have caused did not happen, because a
+ * relaxed timer was deferred past them or ran along with somebody
+ * else's wakeup.
+ */
+static void led_stats_saved(struct led_stats __percpu *stats, u64 n)
+{
+    this_cpu_add(stats->saved, n);
+    this_cpu_add(led_saved, n);
+}
+
+/*
+ * How late the edges of a LED may come. Relaxed LEDs let the timers
+ * of the timer, hrtimer and kthread engines coalesce with other
+ * wakeups. The shared and bcm engines always run exact.
+ */
+static u64 led_slack_ns(const struct led_config *cfg)
+{
+    return cfg->relaxed ? (u64)relaxed_slack_us * NSEC_PER_USEC : 0;
+}
+
+static void led_pin_set(struct led_dev *dev, int value)
+{
+    if (dev->pinval != value)
+        this_cpu_inc(dev->stats->edges);
+
+    dev->pinval = value;
+    gpio_set_value(dev->gpiopin, value);
+}
+
+/*
+ * Pin changes collected by the engines that drive several LEDs from
+ * one timer, written with as few gpiod_set_array_value() calls as
+ * possible. Unchanged pins are skipped, their state is only kept in
+ * dev->pinval and never read back.
+ */
+struct led_pins {
+    unsigned int n;
+    struct gpio_desc *descs[LED_PINS_CHUNK];
+    DECLARE_BITMAP(values, LED_PINS_CHUNK);
+};
+
+static void led_pins_flush(struct led_pins *pins)
+{
+    if (pins->n)
+        gpiod_set_array_value(pins->n, pins->descs, NULL, pins->values);
+    pins->n = 0;
+}
+
+static void led_pins_add(struct led_pins *pins, struct led_dev *dev, int value)
+{
+    if (dev->pinval == value)
+        return;
+
+    this_cpu_inc(dev->stats->edges);
+    dev->pinval = value;
+    pins->descs[pins->n] = dev->desc;
+    __assign_bit(pins->n, pins->values, value);
+
+    if (++pins->n == LED_PINS_CHUNK)
+        led_pins_flush(pins);
+}
+
+
+static void led_release(struct kref *ref)
+{
+    struct led_dev *dev = container_of(ref, struct led_dev, ref);
+
+    free_percpu(dev->stats);
+    kfree(dev->name);
+    kfree(dev);
+}
+
+/*
+ * Look up the LED with minor index and take a reference on it.
+ */
+static struct led_dev *led_get(unsigned int index)
+{
+    struct led_dev *dev;
+
+    mutex_lock(&led_idr_lock);
+    dev = idr_find(&led_idr, index);
+    if (dev)
+        kref_get(&dev->ref);
+    mutex_unlock(&led_idr_lock);
+
+    return dev;
+}
+
+static void led_put(struct led_dev *dev)
+{
+    kref_put(&dev->ref, led_release);
+}
+
+/*
+ * Take the writer lock of dev. Fails once dev has been destroyed
+ * underneath an open file. With nowait set fails with -EAGAIN
+ * instead of sleeping on a busy lock.
+ */
+static int __led_lock(struct led_dev *dev, bool nowait)
+{
+    if (nowait) {
+        if (!mutex_trylock(&dev->lock))
+            return -EAGAIN;
+    } else if (mutex_lock_interruptible(&dev->lock)) {
+        return -ERESTARTSYS;
+    }
+
+    if (dev->dead) {
+        mutex_unlock(&dev->lock);
+        return -ENODEV;
+    }
+
+    return 0;
+}
+
+static int led_lock(struct led_dev *dev)
+{
+    return __led_lock(dev, false);
+}
+
+
+/* 
+ * ===============================================
+ *            Configuration publishing
+ * ===============================================
+ */
+
+static void led_config_read(struct led_dev *dev, struct led_config *cfg)
+{
+    unsigned int seq;
+
+    do {
+        seq = read_seqbegin(&dev->cfg_lock);
+        *cfg = dev->cfg;
+    } while (read_seqretry(&dev->cfg_lock, seq));
+}
+
+/*
+ * Publish cfg as the configuration of dev. Returns 1 if the engine
+ * of dev is running, it then picks cfg up at its next period.
+ */
+static int led_config_publish(struct led_dev *dev, struct led_config *cfg)
+{
+    unsigned long flags;
+    int running;
+
+    write_seqlock_irqsave(&dev->cfg_lock, flags);
+    cfg->generation = dev->cfg.generation + 1;
+    dev->cfg = *cfg;
+    running = dev->running;
+    write_sequnlock_irqrestore(&dev->cfg_lock, flags);
+
+    return running;
+}
+
+/*
+ * Make cfg the snapshot the engine runs. Only the engine of dev, or
+ * whoever starts it, writes dev->run, so there is a single writer at
+ * a time. run_seq lets others, see led_state_fill(), read it whole.
+ */
+static void led_run_set(struct led_dev *dev, const struct led_config *cfg)
+{
+    unsigned long flags;
+
+    local_irq_save(flags);
+    write_seqcount_begin(&dev->run_seq);
+    dev->run = *cfg;
+    write_seqcount_end(&dev->run_seq);
+    local_irq_restore(flags);
+}
+
+static void led_run_read(struct led_dev *dev, struct led_config *cfg)
+{
+    unsigned int seq;
+
+    do {
+        seq = read_seqcount_begin(&dev->run_seq);
+        *cfg = dev->run;
+    } while (read_seqcount_retry(&dev->run_seq, seq));
+}
+
+static void led_set_running(struct led_dev *dev, int running)
+{
+    unsigned long flags;
+
+    read_seqlock_excl_irqsave(&dev->cfg_lock, flags);
+    dev->running = running;
+    read_sequnlock_excl_irqrestore(&dev->cfg_lock, flags);
+}
+
+
+/* 
+ * ===============================================
+ *            Shared brightness page
+ * ===============================================
+ */
+
+/*
+ * While the page is mapped anywhere the engines keep their timers
+ * running even for LEDs that are fully on or off, otherwise nobody
+ * would notice a new target for them.
+ */
+static led_shm_t *led_shm;
+static atomic_t led_shm_users = ATOMIC_INIT(0);
+
+static int led_shm_active(void)
+{
+    return atomic_read(&led_shm_users) > 0;
+}
+
+/*
+ * Report the configuration dev runs with. Keeping target in step
+ * means a later generation bump for some other LED does not revert a
+ * change made through write() or ioctl().
+ */
+static void led_shm_publish(struct led_dev *dev, const struct led_config *cfg,
+                            int update_target)
+{
+    led_shm_led_t *led = &led_shm->led[dev->index];
+
+    if (update_target)
+        WRITE_ONCE(led->target, cfg->brightness);
+    WRITE_ONCE(led->applied, cfg->brightness);
+    WRITE_ONCE(led->engine, cfg->engine);
+}
+
+/*
+ * Pick up a new target for dev from the page if userspace has bumped
+ * the generation since we last looked.
+ */
+static void led_shm_sync(struct led_dev *dev, unsigned int *brightness)
+{
+    u32 generation;
+
+    if (!led_shm_active())
+        return;
+
+    generation = smp_load_acquire(&led_shm->generation);
+    if (generation == dev->shm_generation)
+        return;
+
+    dev->shm_generation = generation;
+    WRITE_ONCE(led_shm->applied_generation, generation);
+
+    *brightness = READ_ONCE(led_shm->led[dev->index].target);
+}
+
+static void led_shm_vm_open(struct vm_area_struct *vma)
+{
+    atomic_inc(&led_shm_users);
+}
+
+static void led_shm_vm_close(struct vm_area_struct *vma)
+{
+    atomic_dec(&led_shm_users);
+}
+
+static const struct vm_operations_struct led_shm_vm_ops = {
+    .open  = led_shm_vm_open,
+    .close = led_shm_vm_close,
+};
+
+
+/* 
+ * ===============================================
+ *            Pattern player
+ * ===============================================
+ */
+
+/*
+ * Work out the brightness the pattern asks for at time now, moving
+ * on to later keyframes as their time runs out. Returns 0 once the
+ * last play has ended, brightness then is the final keyframe.
+ */
+static int led_pattern_eval(struct led_pattern *pat, ktime_t now,
+                            unsigned int *brightness)
+{
+    led_keyframe_t *frame, *next;
+    u64 elapsed, duration;
+    int delta;
+
+    elapsed = ktime_after(now, pat->frame_start) ?
+              ktime_to_ns(ktime_sub(now, pat->frame_start)) : 0;
+
+    for (;;) {
+        frame = &pat->frames[pat->frame];
+        duration = (u64)frame->duration_ms * NSEC_PER_MSEC;
+        if (elapsed < duration)
+            break;
+
+        elapsed -= duration;
+        pat->frame_start = ktime_add_ns(pat->frame_start, duration);
+
+        if (++pat->frame == pat->count) {
+            if (pat->repeat && --pat->repeat == 0) {
+                pat->frame--;
+                *brightness = frame->brightness;
+                return 0;
+            }
+            pat->frame = 0;
+        }
+    }
+
+    *brightness = frame->brightness;
+    if (!(pat->flags & LED_PATTERN_INTERPOLATE))
+        return 1;
+
+    if (pat->frame + 1 < pat->count)
+        next = frame + 1;
+    else if (pat->repeat != 1)
+        next = &pat->frames[0];
+    else
+        next = frame;
+
+    delta = (int)next->brightness - (int)frame->brightness;
+    if (delta >= 0)
+        *brightness += div64_u64(delta * elapsed, duration);
+    else
+        *brightness -= div64_u64(-delta * elapsed, duration);
+
+    return 1;
+}
+
+/*
+ * Copy the position of the pattern where led_snapshot() can read it
+ * without stopping the engine.
+ */
+static void led_pattern_publish(struct led_dev *dev)
+{
+    WRITE_ONCE(dev->pattern_frame, dev->pattern ? dev->pattern->frame : -1);
+    WRITE_ONCE(dev->pattern_repeat, dev->pattern ? dev->pattern->repeat : 0);
+}
+
+/*
+ * Drop the pattern of dev. The engine must be stopped, or we must be
+ * running from its timer.
+ */
+static void led_pattern_clear(struct led_dev *dev)
+{
+    kfree(dev->pattern);
+    dev->pattern = NULL;
+    led_pattern_publish(dev);
+}
+
+
+/*
+ * Tell pollers of dev that its state changed. Safe from timer
+ * context.
+ */
+static void led_notify(struct led_dev *dev)
+{
+    atomic_inc(&dev->events);
+    wake_up_interruptible_poll(&dev->wait, EPOLLIN | EPOLLRDNORM);
+}
+
+/*
+ * The engine of dev has started to run dev->run.
+ */
+static void led_config_applied(struct led_dev *dev)
+{
+    this_cpu_inc(dev->stats->changes);
+    trace_led_brightness_applied(dev->index, dev->run.engine,
+                                 dev->run.brightness, dev->run.generation);
+    led_notify(dev);
+}
+
+/*
+ * Called by the engines at the start of every period with the time
+ * the period starts at. Picks up a new target from the shared page
+ * or the pattern, and takes the snapshot the engine runs the period
+ * with. Returns 1 if the snapshot differs from the last period. Runs
+ * in timer context, so this must not sleep.
+ */
+static int led_period_sync(struct led_dev *dev, ktime_t now)
+{
+    struct led_config cfg;
+    unsigned int brightness;
+    unsigned long flags;
+    u32 generation = dev->run.generation;
+
+    led_config_read(dev, &cfg);
+    brightness = cfg.brightness;
+
+    led_shm_sync(dev, &brightness);
+
+    if (dev->pattern) {
+        if (led_pattern_eval(dev->pattern, now, &brightness)) {
+            led_pattern_publish(dev);
+        } else {
+            led_pattern_clear(dev);
+            led_notify(dev);
+        }
+    }
+
+    if (brightness != cfg.brightness) {
+        cfg.brightness = brightness;
+        led_engines[cfg.engine].config(&cfg);
+
+        /* A writer that got in since our snapshot wins */
+        write_seqlock_irqsave(&dev->cfg_lock, flags);
+        if (dev->cfg.generation == cfg.generation) {
+            cfg.generation++;
+            dev->cfg = cfg;
+        } else {
+            cfg = dev->cfg;
+        }
+        write_sequnlock_irqrestore(&dev->cfg_lock, flags);
+
+        led_shm_publish(dev, &cfg, 0);
+    }
+
+    led_run_set(dev, &cfg);
+
+    if (cfg.generation == generation)
+        return 0;
+
+    led_config_applied(dev);
+    return 1;
+}
+
+/*
+ * Engines normally let their timer go for LEDs that are fully on or
+ * off. They must not while somebody else may change the brightness
+ * behind their back.
+ */
+static int led_keep_running(struct led_dev *dev)
+{
+    return led_shm_active() || dev->pattern;
+}
+
+/*
+ * Called by an engine when its snapshot leaves nothing to toggle.
+ * Returns 1 if it may let its timer go. This is decided under
+ * cfg_lock, so a concurrent writer either sees the engine running and
+ * relies on it to pick up the new configuration, or sees it stopped
+ * and restarts it.
+ */
+static int led_engine_idle(struct led_dev *dev)
+{
+    unsigned long flags;
+    int idle;
+
+    read_seqlock_excl_irqsave(&dev->cfg_lock, flags);
+    idle = dev->cfg.generation == dev->run.generation &&
+           !led_keep_running(dev);
+    if (idle)
+        dev->running = 0;
+    read_sequnlock_excl_irqrestore(&dev->cfg_lock, flags);
+
+    return idle;
+}
+
+/* 
+ * ===============================================
+ *            Brightness curves
+ * ===============================================
+ */
+
+/*
+ * The brightness curve maps the 256 brightness levels to duty cycles,
+ * and on to what every engine runs for them. It is worked out when
+ * the curve is set, so configuring an engine is a table lookup.
+ * Readers use RCU, the engines look up from timer context.
+ */
+struct led_curve {
+    u32 duty[LED_CURVE_SIZE];
+    struct led_duty engine[LED_ENGINE_COUNT][LED_CURVE_SIZE];
+};
+
+static struct led_curve __rcu *led_curve;
+static DEFINE_MUTEX(led_curve_lock);    /* serializes led_curve_set() */
+
+/*
+ * Fill in cfg->duty and d for the engine and brightness of cfg.
+ */
+static void led_curve_lookup(struct led_config *cfg, struct led_duty *d)
+{
+    const struct led_curve *curve;
+
+    rcu_read_lock();
+    curve = rcu_dereference(led_curve);
+    cfg->duty = curve->duty[cfg->brightness];
+    *d = curve->engine[cfg->engine][cfg->brightness];
+    rcu_read_unlock();
+}
+
+/*
+ * Make duty the brightness curve and reconfigure every LED with it.
+ * The LEDs pick it up at their next period.
+ */
+static int led_curve_set(const u32 *duty)
+{
+    struct led_curve *curve, *old;
+    struct led_config cfg;
+    struct led_dev *dev;
+    int e, b, id;
+
+    curve = vmalloc(sizeof(*curve));
+    if (curve == NULL)
+        return -ENOMEM;
+
+    memcpy(curve->duty, duty, sizeof(curve->duty));
+    for (e = 0; e < LED_ENGINE_COUNT; e++)
+        for (b = 0; b < LED_CURVE_SIZE; b++)
+            led_engines[e].curve(duty[b], &curve->engine[e][b]);
+
+    mutex_lock(&led_curve_lock);
+    old = rcu_dereference_protected(led_curve,
+                                    lockdep_is_held(&led_curve_lock));
+    rcu_assign_pointer(led_curve, curve);
+
+    mutex_lock(&led_idr_lock);
+    idr_for_each_entry(&led_idr, dev, id) {
+        mutex_lock(&dev->lock);
+        led_config_read(dev, &cfg);
+        led_config_commit(dev, &cfg, 0);
+        mutex_unlock(&dev->lock);
+    }
+    mutex_unlock(&led_idr_lock);
+    mutex_unlock(&led_curve_lock);
+
+    synchronize_rcu();
+    vfree(old);
+    return 0;
+}
+
+/*
+ * LED_IOCTL_SET_CURVE. Userspace hands in 16 bit duty cycles with
+ * 65535 for always on.
+ */
+static long led_curve_upload(const led_ioctl_curve_t *req)
+{
+    u16 *user;
+    u32 *duty;
+    long ret;
+    int b;
+
+    if (req->duty == 0)
+        return led_curve_set(led_curve_builtin);
+
+    user = memdup_user(u64_to_user_ptr(req->duty),
+                       LED_CURVE_SIZE * sizeof(*user));
+    if (IS_ERR(user))
+        return PTR_ERR(user);
+
+    duty = kmalloc_array(LED_CURVE_SIZE, sizeof(*duty), GFP_KERNEL);
+    if (duty == NULL) {
+        kfree(user);
+        return -ENOMEM;
+    }
+
+    for (b = 0; b < LED_CURVE_SIZE; b++)
+        duty[b] = DIV_ROUND_CLOSEST((u32)user[b] << LED_DUTY_SHIFT, 0xffff);
+
+    ret = led_curve_set(duty);
+    kfree(duty);
+    kfree(user);
+    return ret;
+}
+
+static void led_curve_exit(void)
+{
+    vfree(rcu_dereference_protected(led_curve, 1));
+}
+
+
+/* 
+ * ===============================================
+ *            timer_list PWM engine
+ * ===============================================
+ */
+
+/*
+ * Each edge is rounded down to whole jiffies, a non-zero interval
+ * that rounds to nothing still waits for the next tick.
+ */
+static unsigned long led_timer_msecs_to_jiffies(unsigned int msecs)
+{
+    unsigned long j = (msecs * HZ) / 1000;
+
+    return (msecs && !j) ? 1 : j;
+}
+
+/*
+ * Jiffies advance on a fixed grid of TICK_NSEC in ktime, so one tick
+ * seen at load time places every later one. Lateness of the timer
+ * engine is then measured from the tick its timer expires on, like
+ * that of the hrtimer engines from their expiry, and not from a time
+ * up to a tick off.
+ */
+static u64 led_jiffy_base;
+static ktime_t led_jiffy_ktime;
+
+static void led_timer_calibrate(void)
+{
+    unsigned long j;
+
+    /* Wait for a tick that advances jiffies by exactly one */
+    do {
+        j = jiffies;
+        while (jiffies == j)
+            cpu_relax();
+        led_jiffy_ktime = ktime_get();
+        led_jiffy_base = get_jiffies_64();
+    } while ((unsigned long)led_jiffy_base != j + 1);
+}
+
+static ktime_t led_jiffies_to_ktime(u64 j)
+{
+    return ktime_add_ns(led_jiffy_ktime, (j - led_jiffy_base) * TICK_NSEC);
+}
+
+/* Called with timer_lock held */
+static void led_timer_start(struct led_dev *dev, unsigned long delay)
+{
+    u64 expires = get_jiffies_64() + delay;
+
+    dev->timer_armed = 1;
+    dev->timer_due = led_jiffies_to_ktime(expires);
+    mod_timer(&dev->timer, expires);
+    if (dev->run.relaxed)
+        mod_timer(&dev->timer_backstop,
+                  expires + usecs_to_jiffies(relaxed_slack_us));
+}
+
+static void led_timer_stop(struct led_dev *dev)
+{
+    /* Either timer may rearm the other until both are stopped */
+    do {
+        timer_delete_sync(&dev->timer);
+        timer_delete_sync(&dev->timer_backstop);
+    } while (timer_pending(&dev->timer) || timer_pending(&dev->timer_backstop));
+}
+
+
+static int led_timer_static(const struct led_config *cfg)
+{
+    if (cfg->dither)
+        return cfg->duty == 0 || cfg->duty == LED_DUTY_ONE;
+
+    return cfg->msec_on == 0 || cfg->msec_off == 0;
+}
+
+/*
+ * First order sigma-delta: the on time of every period is rounded
+ * down to whole jiffies and the remainder carried over to the next
+ * one. Averaged over a few periods each of the 256 brightness levels
+ * gets its own duty cycle however coarse the tick is.
+ */
+static void led_timer_dither(struct led_dev *dev, unsigned long *on,
+                             unsigned long *off)
+{
+    unsigned long period = led_timer_msecs_to_jiffies(PWM_PERIOD);
+    u64 total = (u64)period * dev->run.duty + dev->dither_err;
+
+    *on = total >> LED_DUTY_SHIFT;
+    *off = period - *on;
+    dev->dither_err = total & (LED_DUTY_ONE - 1);
+}
+
+static void led_timer_edge(struct led_dev *dev)
+{
+    unsigned long on, off;
+
+    if (!dev->period_edge) {
+        led_pin_set(dev, 0);
+        dev->period_edge = 1;
+        led_timer_start(dev, dev->timer_off);
+        return;
+    }
+
+    led_period_sync(dev, ktime_get());
+
+    if (dev->run.dither) {
+        led_timer_dither(dev, &on, &off);
+    } else {
+        on = led_timer_msecs_to_jiffies(dev->run.msec_on);
+        off = led_timer_msecs_to_jiffies(dev->run.msec_off);
+    }
+
+    led_pin_set(dev, on != 0);
+
+    if (on && off) {
+        dev->period_edge = 0;
+        dev->timer_off = off;
+        led_timer_start(dev, on);
+    } else if (!led_timer_static(&dev->run) || !led_engine_idle(dev)) {
+        led_timer_start(dev, on + off);
+    }
+} 
+
+static void led_timer_toggle_led(struct led_dev *dev)
+{
+    ktime_t now = ktime_get();
+    s64 late = ktime_to_ns(ktime_sub(now, dev->timer_due));
+    u64 missed;
+
+    trace_led_timer_fired(dev->index, LED_ENGINE_TIMER, dev->timer_due, now);
+    led_stats_fired(dev->stats, dev->timer_due, now);
+
+    if (dev->period_edge && late >= PWM_PERIOD * NSEC_PER_MSEC) {
+        missed = div_u64(late, PWM_PERIOD * NSEC_PER_MSEC);
+        this_cpu_add(dev->stats->missed, missed);
+
+        /* A deferred timer slept through these periods */
+        if (dev->run.relaxed)
+            led_stats_saved(dev->stats,
+                            led_timer_static(&dev->run) ? missed : 2 * missed);
+    }
+
+    led_timer_edge(dev);
+    led_stats_done(dev->stats, now);
+}
+
+/*
+ * Relaxed LEDs get a deferrable timer, which does not wake an idle
+ * CPU and fires with the next wakeup that happens anyway. On a CPU
+ * that stays idle that could be never, so an ordinary backstop timer
+ * relaxed_slack_us later bounds the wait. Whichever fires first runs
+ * the edge, the other one finds it taken, or the next edge not due
+ * yet, and does nothing.
+ */
+static void led_timer_expired(struct led_dev *dev)
+{
+    spin_lock(&dev->timer_lock);
+    if (dev->timer_armed && !time_before(jiffies, dev->timer.expires)) {
+        dev->timer_armed = 0;
+        timer_delete(&dev->timer);
+        timer_delete(&dev->timer_backstop);
+        led_timer_toggle_led(dev);
+    }
+    spin_unlock(&dev->timer_lock);
+}
+
+static void led_timer_fired(struct timer_list *t)
+{
+    struct led_dev *dev = timer_container_of(dev, t, timer);
+
+    led_timer_expired(dev);
+}
+
+static void led_timer_backstop(struct timer_list *t)
+{
+    struct led_dev *dev = timer_container_of(dev, t, timer_backstop);
+
+    led_timer_expired(dev);
+}
+
+static void led_timer_init(struct led_dev *dev)
+{
+    timer_setup(&dev->timer, led_timer_fired,
+                dev->run.relaxed ? TIMER_DEFERRABLE : 0);
+    timer_setup(&dev->timer_backstop, led_timer_backstop, 0);
+}
+
+static void led_timer_curve(u32 duty, struct led_duty *out)
+{
+    out->on = ((u64)PWM_PERIOD * duty + LED_DUTY_ONE / 2) >> LED_DUTY_SHIFT;
+    out->off = PWM_PERIOD - out->on;
+}
+
+static void led_timer_config(struct led_config *cfg)
+{
+    struct led_duty d;
+
+    led_curve_lookup(cfg, &d);
+    cfg->msec_on = d.on;
+    cfg->msec_off = d.off;
+}
+
+/*
+ * The first period starts on the tick at or after edge, or right away
+ * if edge has passed.
+ */
+static void led_timer_run(struct led_dev *dev, ktime_t edge)
+{
+    ktime_t now = ktime_get();
+
+    led_timer_init(dev);
+    dev->period_edge = 1;
+
+    spin_lock_bh(&dev->timer_lock);
+    if (ktime_after(edge, now))
+        led_timer_start(dev, usecs_to_jiffies(ktime_us_delta(edge, now)));
+    else
+        led_timer_edge(dev);
+    spin_unlock_bh(&dev->timer_lock);
+}
+
+static void led_timer_info(const struct led_config *cfg,
+                           led_ioctl_engine_t *info)
+{
+    unsigned long on = led_timer_msecs_to_jiffies(cfg->msec_on);
+    unsigned long off = led_timer_msecs_to_jiffies(cfg->msec_off);
+
+    info->period_ns = jiffies_to_usecs(on + off) * NSEC_PER_USEC;
+    info->on_ns = jiffies_to_usecs(on) * NSEC_PER_USEC;
+    info->resolution_ns = TICK_NSEC;
+    info->steps = (PWM_PERIOD * HZ) / 1000 + 1;
+
+    /* Dithering only gets there on average */
+    if (cfg->dither) {
+        info->period_ns = jiffies_to_usecs(led_timer_msecs_to_jiffies(
+                              PWM_PERIOD)) * NSEC_PER_USEC;
+        info->on_ns = ((u64)info->period_ns * cfg->duty) >> LED_DUTY_SHIFT;
+        info->steps = 256;
+    }
+}
+
+
+/* 
+ * ===============================================
+ *            hrtimer PWM engine
+ * ===============================================
+ */
+
+static void led_hrtimer_curve(u32 duty, struct led_duty *out)
+{
+    u64 period = (u64)hrperiod_us * NSEC_PER_USEC;
+
+    out->on = (period * duty) >> LED_DUTY_SHIFT;
+    out->off = period - out->on;
+}
+
+static void led_hrtimer_config(struct led_config *cfg)
+{
+    struct led_duty d;
+
+    led_curve_lookup(cfg, &d);
+    cfg->nsec_on = d.on;
+    cfg->nsec_off = d.off;
+}
+
+static int led_hrtimer_static(const struct led_config *cfg)
+{
+    return cfg->nsec_on == 0 || cfg->nsec_off == 0;
+}
+
+static enum hrtimer_restart led_hrtimer_edge(struct led_dev *dev,
+                                             struct hrtimer *timer)
+{
+    u64 delay;
+
+    if (!dev->period_edge) {
+        led_pin_set(dev, 0);
+        dev->period_edge = 1;
+        delay = dev->run.nsec_off;
+    } else {
+        led_period_sync(dev, hrtimer_get_expires(timer));
+        led_pin_set(dev, dev->run.nsec_on != 0);
+
+        if (!led_hrtimer_static(&dev->run)) {
+            dev->period_edge = 0;
+            delay = dev->run.nsec_on;
+        } else if (!led_engine_idle(dev)) {
+            delay = dev->run.nsec_on + dev->run.nsec_off;
+        } else {
+            return HRTIMER_NORESTART;
+        }
+    }
+
+    /*
+     * Advance from the previous expiry rather than from now so that
+     * callback latency does not accumulate into the period. When we
+     * have fallen behind by more than an edge, skip ahead on the
+     * period grid instead of replaying every missed edge.
+     */
+    hrtimer_add_expires_ns(timer, delay);
+    if (ktime_before(hrtimer_get_expires(timer), ktime_get()))
+        this_cpu_add(dev->stats->missed, hrtimer_forward_now(timer,
+                     ns_to_ktime(dev->run.nsec_on + dev->run.nsec_off)));
+
+    return HRTIMER_RESTART;
+}
+
+static enum hrtimer_restart led_hrtimer_toggle_led(struct hrtimer *timer)
+{
+    struct led_dev *dev = container_of(timer, struct led_dev, hrtimer);
+    ktime_t now = ktime_get();
+    enum hrtimer_restart ret;
+
+    trace_led_timer_fired(dev->index, LED_ENGINE_HRTIMER,
+                          hrtimer_get_expires(timer), now);
+    led_stats_fired(dev->stats, hrtimer_get_expires(timer), now);
+
+    /* Ahead of the hard expiry, so run along with another interrupt */
+    if (ktime_before(now, hrtimer_get_expires(timer)))
+        led_stats_saved(dev->stats, 1);
+
+    ret = led_hrtimer_edge(dev, timer);
+
+    led_stats_done(dev->stats, now);
+    return ret;
+}
+
+static void led_hrtimer_init(struct led_dev *dev)
+{
+    hrtimer_setup(&dev->hrtimer, led_hrtimer_toggle_led, CLOCK_MONOTONIC,
+                  HRTIMER_MODE_REL);
+}
+
+/*
+ * Even a LED that is fully on or off waits for edge, so that all LEDs
+ * of a batch change together.
+ */
+static void led_hrtimer_run(struct led_dev *dev, ktime_t edge)
+{
+    /* The slack carries over as the expiry is advanced */
+    dev->period_edge = 1;
+    hrtimer_start_range_ns(&dev->hrtimer, edge, led_slack_ns(&dev->run),
+                           HRTIMER_MODE_ABS);
+}
+
+static void led_hrtimer_stop(struct led_dev *dev)
+{
+    hrtimer_cancel(&dev->hrtimer);
+}
+
+static void led_hrtimer_info(const struct led_config *cfg,
+                             led_ioctl_engine_t *info)
+{
+    u64 period = cfg->nsec_on + cfg->nsec_off;
+
+    info->period_ns = period;
+    info->on_ns = cfg->nsec_on;
+    info->resolution_ns = hrtimer_resolution;
+    info->steps = min_t(u64, div_u64(period, hrtimer_resolution) + 1, 256);
+}
+
+
+/* 
+ * ===============================================
+ *            shared tick PWM engine
+ * ===============================================
+ */
+
+/*
+ * All LEDs on the shared engine run from a single hrtimer. Every
+ * period starts with one edge switching all of them on, after that
+ * the timer visits the on times in ascending order and switches off
+ * every LED whose on time has passed. On times are quantized to
+ * shared_steps, so there are at most shared_steps + 1 wakeups per
+ * period however many LEDs are attached.
+ *
+ * Pin state is only kept in dev->pinval, the pins are never read
+ * back, and the pins changing on an edge are written together, see
+ * struct led_pins.
+ */
+struct led_shared {
+    spinlock_t lock;
+    struct hrtimer timer;
+    int running;
+    int period_edge;              /* next expiry starts a period */
+    ktime_t period_start;
+    struct list_head leds;        /* attached LEDs by run.nsec_on */
+    struct list_head *next;       /* first LED in leds still on */
+    struct led_pins pins;
+};
+
+static struct led_shared led_shared;
+static DEFINE_PER_CPU(struct led_stats, led_shared_stats);
+
+static u64 led_shared_period_ns(void)
+{
+    return (u64)hrperiod_us * NSEC_PER_USEC;
+}
+
+static void led_shared_curve(u32 duty, struct led_duty *out)
+{
+    u64 period = led_shared_period_ns();
+    u64 steps = ((u64)shared_steps * duty + LED_DUTY_ONE / 2) >> LED_DUTY_SHIFT;
+
+    out->on = div_u64(period, shared_steps) * steps;
+    out->off = period - out->on;
+}
+
+static void led_shared_config(struct led_config *cfg)
+{
+    struct led_duty d;
+
+    led_curve_lookup(cfg, &d);
+    cfg->nsec_on = d.on;
+    cfg->nsec_off = d.off;
+}
+
+static int led_shared_static(const struct led_config *cfg)
+{
+    return cfg->nsec_on == 0 || cfg->nsec_off == 0;
+}
+
+/*
+ * Switch the LEDs from up to (not including) to off, or on if on is
+ * set and their on time is not zero. Called with led_shared.lock held.
+ */
+static void led_shared_write(struct list_head *from, struct list_head *to,
+                             int on)
+{
+    struct led_shared *shared = &led_shared;
+    struct list_head *pos;
+
+    for (pos = from; pos != to; pos = pos->next) {
+        struct led_dev *dev = list_entry(pos, struct led_dev, engine_node);
+
+        led_pins_add(&shared->pins, dev, on && dev->run.nsec_on != 0);
+    }
+
+    led_pins_flush(&shared->pins);
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,13,0)
+static int led_shared_cmp(void *priv, const struct list_head *a,
+                          const struct list_head *b)
+#else
+static int led_shared_cmp(void *priv, struct list_head *a, struct list_head *b)
+#endif
+{
+    u64 on_a = list_entry(a, struct led_dev, engine_node)->run.nsec_on;
+    u64 on_b = list_entry(b, struct led_dev, engine_node)->run.nsec_on;
+
+    return on_a < on_b ? -1 : on_a > on_b;
+}
+
+/*
+ * Start of a period: take new snapshots of all LEDs, switch every LED
+ * with a non-zero on time on and let go of the LEDs that no longer
+ * need the timer. Called with led_shared.lock held.
+ */
+static void led_shared_period(void)
+{
+    struct led_shared *shared = &led_shared;
+    struct led_dev *dev, *tmp;
+    int changed = 0;
+
+    list_for_each_entry(dev, &shared->leds, engine_node)
+        changed |= led_period_sync(dev, shared->period_start);
+
+    if (changed)
+        list_sort(NULL, &shared->leds, led_shared_cmp);
+
+    led_shared_write(shared->leds.next, &shared->leds, 1);
+
+    list_for_each_entry_safe(dev, tmp, &shared->leds, engine_node)
+        if (led_shared_static(&dev->run) && led_engine_idle(dev))
+            list_del_init(&dev->engine_node);
+
+    shared->next = shared->leds.next;
+    while (shared->next != &shared->leds &&
+           list_entry(shared->next, struct led_dev,
+                      engine_node)->run.nsec_on == 0)
+        shared->next = shared->next->next;
+}
+
+static enum hrtimer_restart led_shared_tick(struct hrtimer *timer)
+{
+    struct led_shared *shared = &led_shared;
+    u64 period = led_shared_period_ns();
+    enum hrtimer_restart ret = HRTIMER_RESTART;
+    struct list_head *from;
+    struct led_dev *next;
+    ktime_t now = ktime_get();
+    u64 offset;
+
+    trace_led_timer_fired(-1, LED_ENGINE_SHARED, hrtimer_get_expires(timer),
+                          now);
+    led_stats_fired(&led_shared_stats, hrtimer_get_expires(timer), now);
+
+    spin_lock(&shared->lock);
+
+    if (shared->period_edge) {
+        /* Skip whole periods we were too late for */
+        if (ktime_before(ktime_add_ns(hrtimer_get_expires(timer), period),
+                         now))
+            this_cpu_add(led_shared_stats.missed,
+                         hrtimer_forward_now(timer, ns_to_ktime(period)));
+
+        shared->period_start = hrtimer_get_expires(timer);
+        shared->period_edge = 0;
+        led_shared_period();
+    } else {
+        offset = ktime_to_ns(ktime_sub(hrtimer_get_expires(timer),
+                                       shared->period_start));
+        from = shared->next;
+        while (shared->next != &shared->leds &&
+               list_entry(shared->next, struct led_dev,
+                          engine_node)->run.nsec_on <= offset)
+            shared->next = shared->next->next;
+
+        led_shared_write(from, shared->next, 0);
+    }
+
+    next = shared->next != &shared->leds ?
+           list_entry(shared->next, struct led_dev, engine_node) : NULL;
+
+    if (list_empty(&shared->leds)) {
+        shared->running = 0;
+        ret = HRTIMER_NORESTART;
+    } else if (next && next->run.nsec_off != 0) {
+        hrtimer_set_expires(timer, ktime_add_ns(shared->period_start,
+                            next->run.nsec_on));
+    } else {
+        hrtimer_set_expires(timer, ktime_add_ns(shared->period_start, period));
+        shared->period_edge = 1;
+    }
+
+    spin_unlock(&shared->lock);
+
+    led_stats_done(&led_shared_stats, now);
+    return ret;
+}
+
+/*
+ * A LED joins with its pin low and is switched on by the next period
+ * edge. A fully on or off LED keeps its pin until that edge sets it
+ * and lets it go. The first LED to join starts the timer with a
+ * period edge at edge.
+ */
+static void led_shared_run(struct led_dev *dev, ktime_t edge)
+{
+    struct led_shared *shared = &led_shared;
+    struct led_dev *pos;
+    unsigned long flags;
+
+    if (!led_shared_static(&dev->run))
+        led_pin_set(dev, 0);
+
+    spin_lock_irqsave(&shared->lock, flags);
+
+    /*
+     * Insert in order. next keeps pointing at the same LED, the new
+     * one is already off so it does not matter which side it ends up.
+     */
+    list_for_each_entry(pos, &shared->leds, engine_node)
+        if (pos->run.nsec_on > dev->run.nsec_on)
+            break;
+    list_add_tail(&dev->engine_node, &pos->engine_node);
+
+    if (!shared->running) {
+        shared->running = 1;
+        shared->period_edge = 1;
+        hrtimer_start(&shared->timer, edge, HRTIMER_MODE_ABS);
+    }
+
+    spin_unlock_irqrestore(&shared->lock, flags);
+}
+
+/*
+ * The timer stops itself on its next expiry once no LED is left, so
+ * it never has to be cancelled with the lock held.
+ */
+static void led_shared_stop(struct led_dev *dev)
+{
+    struct led_shared *shared = &led_shared;
+    unsigned long flags;
+
+    spin_lock_irqsave(&shared->lock, flags);
+
+    if (shared->next == &dev->engine_node)
+        shared->next = shared->next->next;
+    list_del_init(&dev->engine_node);
+
+    spin_unlock_irqrestore(&shared->lock, flags);
+}
+
+static void led_shared_info(const struct led_config *cfg,
+                            led_ioctl_engine_t *info)
+{
+    u64 period = led_shared_period_ns();
+
+    info->period_ns = period;
+    info->on_ns = cfg->nsec_on;
+    info->resolution_ns = div_u64(period, shared_steps);
+    info->steps = shared_steps + 1;
+}
+
+static void led_shared_init(void)
+{
+    spin_lock_init(&led_shared.lock);
+    INIT_LIST_HEAD(&led_shared.leds);
+    led_shared.next = &led_shared.leds;
+    hrtimer_setup(&led_shared.timer, led_shared_tick, CLOCK_MONOTONIC,
+                  HRTIMER_MODE_ABS);
+}
+
+static void led_shared_exit(void)
+{
+    hrtimer_cancel(&led_shared.timer);
+}
+
+
+/* 
+ * ===============================================
+ *            kthread PWM engine
+ * ===============================================
+ */
+
+/*
+ * The kthread engine runs the same schedule as the hrtimer engine, but
+ * from a SCHED_FIFO kernel thread instead of timer interrupts. The
+ * thread sleeps until the earliest edge of all its LEDs, so its edges
+ * are not held up by softirq work on the CPU, and it can be moved to
+ * an isolated CPU with the kthread_cpu parameter, at load time or
+ * later through /sys/module/led/parameters/kthread_cpu.
+ */
+struct led_kthread {
+    spinlock_t lock;
+    struct list_head leds;        /* dev->engine_node, under lock */
+    struct task_struct *task;     /* under kernel_param_lock */
+};
+
+static struct led_kthread led_kthread;
+
+static int kthread_cpu = -1;
+
+static int led_kthread_cpu_set(const char *val, const struct kernel_param *kp)
+{
+    int cpu;
+    int res;
+
+    res = kstrtoint(val, 0, &cpu);
+    if (res)
+        return res;
+
+    if (cpu < -1 || cpu >= (int)nr_cpu_ids)
+        return -EINVAL;
+
+    if (led_kthread.task) {
+        res = set_cpus_allowed_ptr(led_kthread.task,
+                                   cpu < 0 ? cpu_possible_mask :
+                                             cpumask_of(cpu));
+        if (res)
+            return res;
+    }
+
+    kthread_cpu = cpu;
+    return 0;
+}
+
+static const struct kernel_param_ops led_kthread_cpu_ops = {
+    .set = led_kthread_cpu_set,
+    .get = param_get_int,
+};
+
+module_param_cb(kthread_cpu, &led_kthread_cpu_ops, &kthread_cpu,
+                S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(kthread_cpu, "CPU the kthread engine runs on, -1 for any");
+
+/*
+ * Handle the edge of dev that is due, like led_hrtimer_edge(). Returns
+ * 1 if dev has nothing left to toggle and leaves the engine. Called
+ * with led_kthread.lock held.
+ */
+static int led_kthread_edge(struct led_dev *dev, ktime_t now)
+{
+    u64 delay;
+    u64 period;
+    u64 missed;
+
+    if (!dev->period_edge) {
+        led_pin_set(dev, 0);
+        dev->period_edge = 1;
+        delay = dev->run.nsec_off;
+    } else {
+        led_period_sync(dev, dev->kthread_due);
+        led_pin_set(dev, dev->run.nsec_on != 0);
+
+        if (!led_hrtimer_static(&dev->run)) {
+            dev->period_edge = 0;
+            delay = dev->run.nsec_on;
+        } else if (!led_engine_idle(dev)) {
+            delay = dev->run.nsec_on + dev->run.nsec_off;
+        } else {
+            return 1;
+        }
+    }
+
+    /* Keep to the period grid, as the hrtimer engine does */
+    dev->kthread_due = ktime_add_ns(dev->kthread_due, delay);
+    if (ktime_before(dev->kthread_due, now)) {
+        period = dev->run.nsec_on + dev->run.nsec_off;
+        missed = div64_u64(ktime_to_ns(ktime_sub(now, dev->kthread_due)),
+                           period) + 1;
+        dev->kthread_due = ktime_add_ns(dev->kthread_due, missed * period);
+        this_cpu_add(dev->stats->missed, missed);
+    }
+
+    return 0;
+}
+
+/*
+ * The thread sleeps until somewhere between the earliest edge and the
+ * earliest edge plus its slack of all LEDs, so relaxed LEDs are
+ * handled on the wakeups of others where possible.
+ */
+static int led_kthread_fn(void *data)
+{
+    struct led_kthread *kt = &led_kthread;
+    struct led_dev *dev, *tmp;
+    ktime_t now, due, hard, late;
+    int armed;
+
+    while (!kthread_should_stop()) {
+        armed = 0;
+        due = 0;
+        hard = 0;
+
+        spin_lock_irq(&kt->lock);
+
+        now = ktime_get();
+        list_for_each_entry_safe(dev, tmp, &kt->leds, engine_node) {
+            if (!ktime_after(dev->kthread_due, now)) {
+                trace_led_timer_fired(dev->index, LED_ENGINE_KTHREAD,
+                                      dev->kthread_due, now);
+                led_stats_fired(dev->stats, dev->kthread_due, now);
+
+                late = ktime_add_ns(dev->kthread_due, led_slack_ns(&dev->run));
+                if (ktime_before(now, late))
+                    led_stats_saved(dev->stats, 1);
+
+                if (led_kthread_edge(dev, now)) {
+                    list_del_init(&dev->engine_node);
+                    led_stats_done(dev->stats, now);
+                    continue;
+                }
+
+                led_stats_done(dev->stats, now);
+            }
+
+            late = ktime_add_ns(dev->kthread_due, led_slack_ns(&dev->run));
+            if (!armed || ktime_before(dev->kthread_due, due))
+                due = dev->kthread_due;
+            if (!armed || ktime_before(late, hard))
+                hard = late;
+            armed = 1;
+        }
+
+        /* Before unlocking, so a wakeup from led_kthread_run() is not lost */
+        set_current_state(TASK_INTERRUPTIBLE);
+        spin_unlock_irq(&kt->lock);
+
+        if (kthread_should_stop()) {
+            __set_current_state(TASK_RUNNING);
+            break;
+        }
+
+        if (armed)
+            schedule_hrtimeout_range(&due, ktime_to_ns(ktime_sub(hard, due)),
+                                     HRTIMER_MODE_ABS);
+        else
+            schedule();
+    }
+
+    return 0;
+}
+
+/* Fully on or off LEDs wait for edge too, see led_hrtimer_run() */
+static void led_kthread_run(struct led_dev *dev, ktime_t edge)
+{
+    struct led_kthread *kt = &led_kthread;
+    unsigned long flags;
+
+    spin_lock_irqsave(&kt->lock, flags);
+    dev->period_edge = 1;
+    dev->kthread_due = edge;
+    list_add_tail(&dev->engine_node, &kt->leds);
+    spin_unlock_irqrestore(&kt->lock, flags);
+
+    wake_up_process(kt->task);
+}
+
+/*
+ * The thread only looks at dev with the lock held, so dev is left
+ * alone once it is off the list.
+ */
+static void led_kthread_stop(struct led_dev *dev)
+{
+    struct led_kthread *kt = &led_kthread;
+    unsigned long flags;
+
+    spin_lock_irqsave(&kt->lock, flags);
+    list_del_init(&dev->engine_node);
+    spin_unlock_irqrestore(&kt->lock, flags);
+}
+
+static int led_kthread_init(void)
+{
+    struct led_kthread *kt = &led_kthread;
+    struct task_struct *task;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,9,0)
+    struct sched_param param = { .sched_priority = MAX_RT_PRIO / 2 };
+#endif
+    int res = 0;
+
+    spin_lock_init(&kt->lock);
+    INIT_LIST_HEAD(&kt->leds);
+
+    task = kthread_create(led_kthread_fn, NULL, LED_MODULE_NAME "_pwm");
+    if (IS_ERR(task))
+        return PTR_ERR(task);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,9,0)
+    sched_set_fifo(task);
+#else
+    sched_setscheduler(task, SCHED_FIFO, &param);
+#endif
+
+    kernel_param_lock(THIS_MODULE);
+    if (kthread_cpu >= 0)
+        res = set_cpus_allowed_ptr(task, cpumask_of(kthread_cpu));
+    if (res == 0)
+        kt->task = task;
+    kernel_param_unlock(THIS_MODULE);
+
+    if (res) {
+        pr_err("led: unable to move the kthread engine to CPU %d: %d\n",
+               kthread_cpu, res);
+        kthread_stop(task);
+        return res;
+    }
+
+    wake_up_process(task);
+    return 0;
+}
+
+/*
+ * All LEDs are gone by now, the thread is asleep with nothing to do.
+ */
+static void led_kthread_exit(void)
+{
+    struct task_struct *task;
+
+    kernel_param_lock(THIS_MODULE);
+    task = led_kthread.task;
+    led_kthread.task = NULL;
+    kernel_param_unlock(THIS_MODULE);
+
+    kthread_stop(task);
+}
+
+
+/* 
+ * ===============================================
+ *            Hardware PWM
+ * ===============================================
+ */
+
+/*
+ * A LED bound to a PWM channel is driven by the PWM controller
+ * whatever engine is selected. The configuration is turned into a
+ * pwm_state once per change and the CPU has nothing to do in
+ * between. Only while the shared page or a pattern may change the
+ * brightness does a work item look every period, like the timers of
+ * the software engines do. pwm_apply_might_sleep() may sleep, hence the
+ * work item rather than a timer.
+ */
+static void led_pwm_apply(struct led_dev *dev)
+{
+    struct pwm_state state;
+    int ret;
+
+    pwm_get_state(dev->pwm, &state);
+    state.period = pwm_period_ns;
+    state.duty_cycle = ((u64)pwm_period_ns * dev->run.duty) >> LED_DUTY_SHIFT;
+    state.enabled = state.duty_cycle != 0;
+
+    ret = pwm_apply_might_sleep(dev->pwm, &state);
+    if (ret)
+        pr_warn_ratelimited("led%u: unable to apply PWM state: %d\n",
+                            dev->index, ret);
+}
+
+static unsigned long led_pwm_interval(void)
+{
+    return max_t(unsigned long, usecs_to_jiffies(hrperiod_us), 1);
+}
+
+static void led_pwm_work(struct work_struct *work)
+{
+    struct led_dev *dev = container_of(to_delayed_work(work),
+                                       struct led_dev, pwm_work);
+
+    if (led_period_sync(dev, ktime_get()))
+        led_pwm_apply(dev);
+
+    if (!led_engine_idle(dev))
+        schedule_delayed_work(&dev->pwm_work, led_pwm_interval());
+}
+
+static void led_pwm_run(struct led_dev *dev, ktime_t edge)
+{
+    led_pwm_apply(dev);
+
+    if (!led_engine_idle(dev))
+        schedule_delayed_work(&dev->pwm_work, led_pwm_interval());
+}
+
+static void led_pwm_stop(struct led_dev *dev)
+{
+    cancel_delayed_work_sync(&dev->pwm_work);
+}
+
+static void led_pwm_info(const struct led_config *cfg,
+                         led_ioctl_engine_t *info)
+{
+    info->period_ns = pwm_period_ns;
+    info->on_ns = ((u64)pwm_period_ns * cfg->duty) >> LED_DUTY_SHIFT;
+    info->resolution_ns = 1;
+    info->steps = LED_CURVE_SIZE;
+}
+
+/* Not selectable, takes over from the engine of LEDs with a channel */
+static const struct led_engine_ops led_pwm_engine = {
+    .name   = "pwm",
+    .run    = led_pwm_run,
+    .stop   = led_pwm_stop,
+    .info   = led_pwm_info,
+};
+
+
+/* 
+ * ===============================================
+ *            binary code modulation engine
+ * ===============================================
+ */
+
+/*
+ * The brightness of every LED on the BCM engine is reduced to a code
+ * of bcm_bits bits. A period is split into one time slice per bit,
+ * bit b being held for unit << b, and at the start of every slice all
+ * pins are set to the matching bit of their code in one go. That
+ * makes exactly bcm_bits wakeups per period whatever the brightnesses
+ * and however many LEDs are attached.
+ */
+struct led_bcm {
+    spinlock_t lock;
+    struct hrtimer timer;
+    int running;
+    unsigned int plane;           /* bit plane the next expiry starts */
+    struct list_head leds;        /* LEDs synced this period */
+    struct list_head pending;     /* LEDs joining at the next period */
+    struct led_pins pins;
+};
+
+static struct led_bcm led_bcm;
+static DEFINE_PER_CPU(struct led_stats, led_bcm_stats);
+
+static unsigned int led_bcm_max(void)
+{
+    return (1 << bcm_bits) - 1;
+}
+
+/* Time the least significant bit plane is held for */
+static u64 led_bcm_unit_ns(void)
+{
+    return div_u64((u64)hrperiod_us * NSEC_PER_USEC, led_bcm_max());
+}
+
+static void led_bcm_curve(u32 duty, struct led_duty *out)
+{
+    u64 unit = led_bcm_unit_ns();
+
+    out->code = ((u64)led_bcm_max() * duty + LED_DUTY_ONE / 2) >> LED_DUTY_SHIFT;
+    out->on = unit * out->code;
+    out->off = unit * led_bcm_max() - out->on;
+}
+
+static void led_bcm_config(struct led_config *cfg)
+{
+    struct led_duty d;
+
+    led_curve_lookup(cfg, &d);
+    cfg->code = d.code;
+    cfg->nsec_on = d.on;
+    cfg->nsec_off = d.off;
+}
+
+static int led_bcm_static(const struct led_config *cfg)
+{
+    return cfg->code == 0 || cfg->code == led_bcm_max();
+}
+
+/*
+ * Set the pins of the synced LEDs to bit plane of their code. Called
+ * with led_bcm.lock held.
+ */
+static void led_bcm_write(unsigned int plane)
+{
+    struct led_bcm *bcm = &led_bcm;
+    struct led_dev *dev;
+
+    list_for_each_entry(dev, &bcm->leds, engine_node)
+        led_pins_add(&bcm->pins, dev, (dev->run.code >> plane) & 1);
+
+    led_pins_flush(&bcm->pins);
+}
+
+/*
+ * Start of a period: let the pending LEDs join, take new snapshots of
+ * all LEDs and let go of the LEDs that no longer need the timer,
+ * leaving their pin at its final value. Called with led_bcm.lock held.
+ */
+static void led_bcm_period(ktime_t now)
+{
+    struct led_bcm *bcm = &led_bcm;
+    struct led_dev *dev, *tmp;
+
+    list_splice_tail_init(&bcm->pending, &bcm->leds);
+
+    list_for_each_entry_safe(dev, tmp, &bcm->leds, engine_node) {
+        led_period_sync(dev, now);
+
+        if (led_bcm_static(&dev->run) && led_engine_idle(dev)) {
+            led_pin_set(dev, dev->run.code != 0);
+            list_del_init(&dev->engine_node);
+        }
+    }
+}
+
+static enum hrtimer_restart led_bcm_tick(struct hrtimer *timer)
+{
+    struct led_bcm *bcm = &led_bcm;
+    u64 unit = led_bcm_unit_ns();
+    u64 period = unit * led_bcm_max();
+    enum hrtimer_restart ret = HRTIMER_RESTART;
+    ktime_t now = ktime_get();
+
+    trace_led_timer_fired(-1, LED_ENGINE_BCM, hrtimer_get_expires(timer), now);
+    led_stats_fired(&led_bcm_stats, hrtimer_get_expires(timer), now);
+
+    spin_lock(&bcm->lock);
+
+    if (bcm->plane == 0) {
+        /* Skip whole periods we were too late for */
+        if (ktime_before(ktime_add_ns(hrtimer_get_expires(timer), period),
+                         now))
+            this_cpu_add(led_bcm_stats.missed,
+                         hrtimer_forward_now(timer, ns_to_ktime(period)));
+
+        led_bcm_period(hrtimer_get_expires(timer));
+    }
+
+    if (bcm->plane == 0 && list_empty(&bcm->leds)) {
+        bcm->running = 0;
+        ret = HRTIMER_NORESTART;
+    } else {
+        led_bcm_write(bcm->plane);
+        hrtimer_add_expires_ns(timer, unit << bcm->plane);
+        if (++bcm->plane == bcm_bits)
+            bcm->plane = 0;
+    }
+
+    spin_unlock(&bcm->lock);
+
+    led_stats_done(&led_bcm_stats, now);
+    return ret;
+}
+
+/*
+ * A LED joins with its pin low and takes part from the next period on,
+ * so it never shows only part of its bit planes. A fully on or off LED
+ * keeps its pin until that period sets it. The first LED to join
+ * starts the timer with a period at edge.
+ */
+static void led_bcm_run(struct led_dev *dev, ktime_t edge)
+{
+    struct led_bcm *bcm = &led_bcm;
+    unsigned long flags;
+
+    if (!led_bcm_static(&dev->run))
+        led_pin_set(dev, 0);
+
+    spin_lock_irqsave(&bcm->lock, flags);
+
+    list_add_tail(&dev->engine_node, &bcm->pending);
+
+    if (!bcm->running) {
+        bcm->running = 1;
+        bcm->plane = 0;
+        hrtimer_start(&bcm->timer, edge, HRTIMER_MODE_ABS);
+    }
+
+    spin_unlock_irqrestore(&bcm->lock, flags);
+}
+
+/*
+ * Like the shared engine the timer stops itself at the start of the
+ * next period once no LED is left.
+ */
+static void led_bcm_stop(struct led_dev *dev)
+{
+    struct led_bcm *bcm = &led_bcm;
+    unsigned long flags;
+
+    spin_lock_irqsave(&bcm->lock, flags);
+    list_del_init(&dev->engine_node);
+    spin_unlock_irqrestore(&bcm->lock, flags);
+}
+
+static void led_bcm_info(const struct led_config *cfg,
+                         led_ioctl_engine_t *info)
+{
+    u64 unit = led_bcm_unit_ns();
+
+    info->period_ns = unit * led_bcm_max();
+    info->on_ns = cfg->nsec_on;
+    info->resolution_ns = unit;
+    info->steps = led_bcm_max() + 1;
+}
+
+static void led_bcm_init(void)
+{
+    spin_lock_init(&led_bcm.lock);
+    INIT_LIST_HEAD(&led_bcm.leds);
+    INIT_LIST_HEAD(&led_bcm.pending);
+    hrtimer_setup(&led_bcm.timer, led_bcm_tick, CLOCK_MONOTONIC,
+                  HRTIMER_MODE_ABS);
+}
+
+static void led_bcm_exit(void)
+{
+    hrtimer_cancel(&led_bcm.timer);
+}
+
+
+static const struct led_engine_ops led_engines[LED_ENGINE_COUNT] = {
+    [LED_ENGINE_TIMER] = {
+        .name   = "timer",
+        .curve  = led_timer_curve,
+        .config = led_timer_config,
+        .run    = led_timer_run,
+        .stop   = led_timer_stop,
+        .info   = led_timer_info,
+    },
+    [LED_ENGINE_HRTIMER] = {
+        .name   = "hrtimer",
+        .curve  = led_hrtimer_curve,
+        .config = led_hrtimer_config,
+        .run    = led_hrtimer_run,
+        .stop   = led_hrtimer_stop,
+        .info   = led_hrtimer_info,
+    },
+    [LED_ENGINE_SHARED] = {
+        .name   = "shared",
+        .curve  = led_shared_curve,
+        .config = led_shared_config,
+        .run    = led_shared_run,
+        .stop   = led_shared_stop,
+        .info   = led_shared_info,
+    },
+    [LED_ENGINE_BCM] = {
+        .name   = "bcm",
+        .curve  = led_bcm_curve,
+        .config = led_bcm_config,
+        .run    = led_bcm_run,
+        .stop   = led_bcm_stop,
+        .info   = led_bcm_info,
+    },
+    [LED_ENGINE_KTHREAD] = {
+        .name   = "kthread",
+        .curve  = led_hrtimer_curve,
+        .config = led_hrtimer_config,
+        .run    = led_kthread_run,
+        .stop   = led_kthread_stop,
+        .info   = led_hrtimer_info,
+    },
+};
+
+/*
+ * The ops that drive dev with the configuration cfg.
+ */
+static const struct led_engine_ops *led_dev_engine(struct led_dev *dev,
+                                                   const struct led_config *cfg)
+{
+    return dev->pwm ? &led_pwm_engine : &led_engines[cfg->engine];
+}
+
+/*
+ * Restarting a LED goes stop, publish, start. These and everything
+ * below that changes a LED must be called with dev->lock held.
+ */
+static void led_engine_stop(struct led_dev *dev)
+{
+    led_dev_engine(dev, &dev->cfg)->stop(dev);
+    led_set_running(dev, 0);
+}
+
+static void led_engine_start(struct led_dev *dev, ktime_t edge)
+{
+    const struct led_engine_ops *engine = led_dev_engine(dev, &dev->cfg);
+    struct led_config cfg;
+
+    led_config_read(dev, &cfg);
+    led_run_set(dev, &cfg);
+    led_shm_publish(dev, &dev->run, 1);
+    led_set_running(dev, 1);
+    led_config_applied(dev);
+    engine->run(dev, edge);
+}
+
+/*
+ * Make cfg the configuration of dev. While the engine is running and
+ * stays the same it just picks cfg up at its next period, otherwise
+ * the engine is restarted with it. Setting stop_pattern ends pattern
+ * playback, which needs the engine stopped as well.
+ */
+static void led_config_commit(struct led_dev *dev, struct led_config *cfg,
+                              int stop_pattern)
+{
+    led_engines[cfg->engine].config(cfg);
+
+    if (cfg->engine == dev->cfg.engine && cfg->relaxed == dev->cfg.relaxed &&
+        !(stop_pattern && dev->pattern) && led_config_publish(dev, cfg)) {
+        led_shm_publish(dev, cfg, 1);
+        return;
+    }
+
+    led_engine_stop(dev);
+    if (stop_pattern)
+        led_pattern_clear(dev);
+    led_config_publish(dev, cfg);
+    led_engine_start(dev, ktime_get());
+}
+
+static int led_cmd_valid(const led_cmd_t *cmd)
+{
+    if (cmd->led >= LED_MAX || cmd->reserved)
+        return 0;
+
+    switch (cmd->op) {
+        case LED_OP_BRIGHTNESS:
+        case LED_OP_ON:
+        case LED_OP_OFF:
+        case LED_OP_TOGGLE:
+            return 1;
+
+        case LED_OP_ENGINE:
+            return cmd->value < LED_ENGINE_COUNT;
+
+        case LED_OP_DITHER:
+            return cmd->value <= 1;
+
+        case LED_OP_PRECISION:
+            return cmd->value == LED_PRECISION_EXACT ||
+                   cmd->value == LED_PRECISION_RELAXED;
+
+        default:
+            return 0;
+    }
+}
+
+/*
+ * Update cfg the way a (valid) command asks for. Returns 1 if the
+ * command ends pattern playback.
+ */
+static int led_cmd_update(struct led_config *cfg, const led_cmd_t *cmd)
+{
+    switch (cmd->op) {
+        case LED_OP_BRIGHTNESS:
+            cfg->brightness = min_t(u32, cmd->value, 255);
+            return 1;
+
+        case LED_OP_ON:
+            cfg->brightness = 255;
+            return 1;
+
+        case LED_OP_OFF:
+            cfg->brightness = 0;
+            return 1;
+
+        case LED_OP_TOGGLE:
+            cfg->brightness = cfg->brightness ? 0 : 255;
+            return 1;
+
+        case LED_OP_ENGINE:
+            cfg->engine = cmd->value;
+            return 0;
+
+        case LED_OP_DITHER:
+            cfg->dither = cmd->value;
+            return 0;
+
+        case LED_OP_PRECISION:
+            cfg->relaxed = cmd->value == LED_PRECISION_RELAXED;
+            return 0;
+    }
+
+    return 0;
+}
+
+static void led_cmd_apply(struct led_dev *dev, const led_cmd_t *cmd)
+{
+    struct led_config cfg;
+    int stop_pattern;
+
+    led_config_read(dev, &cfg);
+    stop_pattern = led_cmd_update(&cfg, cmd);
+    led_config_commit(dev, &cfg, stop_pattern);
+}
+
+static void led_brightness_set(struct led_dev *dev, unsigned long brightness)
+{
+    led_cmd_t cmd = {
+        .op    = LED_OP_BRIGHTNESS,
+        .value = min_t(unsigned long, brightness, 255),
+    };
+
+    led_cmd_apply(dev, &cmd);
+}
+
+/*
+ * Replace the pattern of dev, a pattern without keyframes just stops
+ * playback and leaves the LED at its current brightness.
+ */
+static long led_pattern_set(struct led_dev *dev, const led_ioctl_pattern_t *req,
+                            bool nowait)
+{
+    struct led_pattern *pat = NULL;
+    struct led_config cfg;
+    ktime_t now;
+    int i, ret;
+
+    if ((req->flags & ~LED_PATTERN_INTERPOLATE) || req->reserved)
+        return -EINVAL;
+    if (req->count > LED_PATTERN_MAX)
+        return -E2BIG;
+
+    if (req->count) {
+        pat = kmalloc(sizeof(*pat) + req->count * sizeof(led_keyframe_t),
+                      GFP_KERNEL);
+        if (pat == NULL)
+            return -ENOMEM;
+
+        if (copy_from_user(pat->frames, u64_to_user_ptr(req->keyframes),
+                           req->count * sizeof(led_keyframe_t))) {
+            kfree(pat);
+            return -EFAULT;
+        }
+
+        for (i = 0; i < req->count; i++) {
+            const led_keyframe_t *kf = &pat->frames[i];
+
+            if (kf->duration_ms == 0 || kf->reserved[0] ||
+                kf->reserved[1] || kf->reserved[2]) {
+                kfree(pat);
+                return -EINVAL;
+            }
+        }
+
+        pat->count = req->count;
+        pat->repeat = req->repeat;
+        pat->flags = req->flags;
+        pat->frame = 0;
+    }
+
+    ret = __led_lock(dev, nowait);
+    if (ret) {
+        kfree(pat);
+        return ret;
+    }
+
+    led_engine_stop(dev);
+    led_pattern_clear(dev);
+
+    now = ktime_get();
+    if (pat) {
+        pat->frame_start = now;
+        dev->pattern = pat;
+        led_pattern_publish(dev);
+
+        led_config_read(dev, &cfg);
+        cfg.brightness = pat->frames[0].brightness;
+        led_engines[cfg.engine].config(&cfg);
+        led_config_publish(dev, &cfg);
+    }
+
+    led_engine_start(dev, now);
+    mutex_unlock(&dev->lock);
+
+    return 0;
+}
+
+/*
+ * Restart every LED, so the engines keep their timers armed for LEDs
+ * that are fully on or off now that the shared page is mapped. Runs
+ * from a work item: led_mmap() holds mmap_lock, and the write paths
+ * fault user memory in, which takes mmap_lock, under dev->lock.
+ */
+static void led_shm_kick(struct work_struct *work)
+{
+    struct led_dev *dev;
+    int id;
+
+    mutex_lock(&led_idr_lock);
+    idr_for_each_entry(&led_idr, dev, id) {
+        mutex_lock(&dev->lock);
+        led_engine_stop(dev);
+        led_engine_start(dev, ktime_get());
+        mutex_unlock(&dev->lock);
+    }
+    mutex_unlock(&led_idr_lock);
+}
+
+static DECLARE_WORK(led_shm_work, led_shm_kick);
+
+
+/* 
+ * ===============================================
+ *                Public Interface
+ * ===============================================
+ */
+
+/* 
+ * ===============================================
+ *                IOCTL Interface
+ * ===============================================
+ */
+
+/*
+ * Generic open call that will always be successful since there is no
+ * extra setup we need to do for this module as far
+ */
+static int led_open(struct inode *inode, struct file *filp)
+{
+    struct led_file *lf;
+
+    lf = kmalloc(sizeof(*lf), GFP_KERNEL);
+    if (lf == NULL)
+        return -ENOMEM;
+
+    lf->dev = led_get(iminor(inode));
+    if (lf->dev == NULL) {
+        kfree(lf);
+        return -ENODEV;
+    }
+
+    lf->format = LED_FORMAT_TEXT;
+    lf->seen = atomic_read(&lf->dev->events);
+    filp->private_data = lf;
+
+    return 0;
+}
+
+
+static int led_close(struct inode *inode, struct file *filp)
+{
+    struct led_file *lf = (struct led_file *)filp->private_data;
+
+    led_put(lf->dev);
+    kfree(lf);
+    return 0;
+}
+
+static ssize_t led_read(struct file *filp, char __user *buff, 
+        size_t count, loff_t *offp)
+{
+    struct led_file *lf = (struct led_file *)filp->private_data;
+    struct led_config cfg;
+    int len = 0;
+    int events;
+    char kbuff[BUFFER_SIZE];  
+
+    /*
+     * The state is read once per change: after the first read we
+     * report end of file until led_notify() was called again, so a
+     * poller just reads again after every wakeup.
+     */
+    events = atomic_read(&lf->dev->events);
+    if (*offp > 0 && events == lf->seen)
+        return 0;
+    lf->seen = events;
+
+    led_config_read(lf->dev, &cfg);
+
+    sprintf(kbuff, "%d\n", cfg.brightness);
+    len = strlen(kbuff);
+    if (copy_to_user(buff, kbuff, len))
+        return -EFAULT;
+
+    *offp += len;
+    return len;
+}
+
+/*
+ * Readable when the state of the LED changed since the file last
+ * read it: a new configuration reached the pin, or a pattern ran out.
+ * Destroyed LEDs hang up.
+ */
+static __poll_t led_poll(struct file *filp, poll_table *wait)
+{
+    struct led_file *lf = (struct led_file *)filp->private_data;
+    struct led_dev *dev = lf->dev;
+    __poll_t mask = 0;
+
+    poll_wait(filp, &dev->wait, wait);
+
+    if (atomic_read(&dev->events) != lf->seen)
+        mask |= EPOLLIN | EPOLLRDNORM;
+    if (!kfifo_is_full(&dev->queue))
+        mask |= EPOLLOUT | EPOLLWRNORM;
+    if (READ_ONCE(dev->dead))
+        mask |= EPOLLHUP;
+
+    return mask;
+}
+
+static ssize_t led_write_text(struct led_dev *dev, struct iov_iter *from,
+                loff_t *offp)
+{   
+    size_t count = iov_iter_count(from);
+    int len = 0;
+    char kbuff[BUFFER_SIZE] = {0};
+    int retval = 0;
+    unsigned long brightness;
+    int ret;
+
+    retval = led_lock(dev);
+    if (retval)
+        return retval;
+
+    len = count < (BUFFER_SIZE-1) ? count : BUFFER_SIZE-1;
+
+    if (copy_from_iter(kbuff, len, from) != len) {
+        retval = -EFAULT;
+        goto out;
+    } 
+
+    *offp += len;
+    retval = len;
+    kbuff[len] = '\0';
+
+    if ((ret = kstrtoul(kbuff, 0, &brightness)) == 0) {
+        trace_led_write_parsed(dev->index, LED_OP_BRIGHTNESS, brightness);
+        led_brightness_set(dev, brightness);
+    } else {
+        pr_warn_ratelimited("led_write: invalid data, errno %d\n", ret);
+    }
+
+
+out:
+    mutex_unlock(&dev->lock);
+    return retval;
+}  
+
+/*
+ * Consume every complete led_cmd_t record, in order. The records are
+ * applied to one copy of the configuration which is committed once,
+ * so the records of one write() or writev() reach the pin together.
+ * Stops at the first invalid record.
+ */
+static ssize_t led_write_records(struct led_dev *dev, struct iov_iter *from)
+{
+    led_cmd_t cmds[RECORD_CHUNK];
+    struct led_config cfg;
+    size_t count = iov_iter_count(from);
+    size_t done = 0, len, copied;
+    ssize_t retval = 0;
+    int i, n, stop_pattern = 0;
+
+    count -= count % sizeof(led_cmd_t);
+    if (count == 0)
+        return -EINVAL;
+
+    retval = led_lock(dev);
+    if (retval)
+        return retval;
+
+    led_config_read(dev, &cfg);
+
+    while (done < count) {
+        len = min_t(size_t, count - done, sizeof(cmds));
+        copied = copy_from_iter(cmds, len, from);
+        n = copied / sizeof(led_cmd_t);
+
+        for (i = 0; i < n; i++) {
+            cmds[i].led = dev->index;
+            if (!led_cmd_valid(&cmds[i])) {
+                retval = -EINVAL;
+                break;
+            }
+            trace_led_write_parsed(dev->index, cmds[i].op, cmds[i].value);
+            stop_pattern |= led_cmd_update(&cfg, &cmds[i]);
+            done += sizeof(led_cmd_t);
+        }
+
+        if (retval == 0 && copied != len)
+            retval = -EFAULT;
+        if (retval)
+            break;
+    }
+
+    if (done)
+        led_config_commit(dev, &cfg, stop_pattern);
+    mutex_unlock(&dev->lock);
+
+    return done ? done : retval;
+}
+
+/*
+ * O_NONBLOCK writes never take dev->lock. Their commands are checked,
+ * put on dev->queue and applied later by led_queue_work(), which folds
+ * everything queued so far into one configuration. Writers only
+ * contend with each other for the moment it takes to copy into the
+ * queue.
+ */
+static void led_queue_work(struct work_struct *work)
+{
+    struct led_dev *dev = container_of(work, struct led_dev, queue_work);
+    led_cmd_t cmds[RECORD_CHUNK];
+    struct led_config cfg;
+    unsigned int i, n, total = 0;
+    int stop_pattern = 0;
+
+    mutex_lock(&dev->lock);
+
+    led_config_read(dev, &cfg);
+    while ((n = kfifo_out(&dev->queue, cmds, RECORD_CHUNK)) > 0) {
+        for (i = 0; i < n; i++)
+            stop_pattern |= led_cmd_update(&cfg, &cmds[i]);
+        total += n;
+    }
+
+    /* A destroyed LED just has its queue emptied */
+    if (total && !dev->dead) {
+        led_config_commit(dev, &cfg, stop_pattern);
+        this_cpu_add(dev->stats->coalesced, total - 1);
+    }
+
+    mutex_unlock(&dev->lock);
+
+    wake_up_interruptible_poll(&dev->wait, EPOLLOUT | EPOLLWRNORM);
+    led_put(dev);
+}
+
+/*
+ * Queue n valid commands. Returns how many fit, the rest is counted
+ * as dropped. A queued work item holds a reference to dev.
+ */
+static unsigned int led_queue_cmds(struct led_dev *dev, const led_cmd_t *cmds,
+                                   unsigned int n)
+{
+    unsigned long flags;
+    unsigned int queued;
+
+    spin_lock_irqsave(&dev->queue_lock, flags);
+    queued = kfifo_in(&dev->queue, cmds, n);
+    dev->queue_peak = max(dev->queue_peak, kfifo_len(&dev->queue));
+    spin_unlock_irqrestore(&dev->queue_lock, flags);
+
+    this_cpu_add(dev->stats->queued, queued);
+    if (queued < n)
+        this_cpu_add(dev->stats->dropped, n - queued);
+
+    if (queued) {
+        kref_get(&dev->ref);
+        if (!queue_work(led_queue_wq, &dev->queue_work))
+            led_put(dev);
+    }
+
+    return queued;
+}
+
+static ssize_t led_write_queue(struct led_file *lf, struct iov_iter *from)
+{
+    struct led_dev *dev = lf->dev;
+    led_cmd_t cmds[RECORD_CHUNK];
+    char kbuff[BUFFER_SIZE] = {0};
+    size_t count = iov_iter_count(from);
+    size_t done = 0, len, copied;
+    unsigned long brightness;
+    unsigned int i, n, queued;
+    int ret;
+
+    if (READ_ONCE(dev->dead))
+        return -ENODEV;
+
+    if (lf->format == LED_FORMAT_TEXT) {
+        len = min_t(size_t, count, BUFFER_SIZE - 1);
+        if (copy_from_iter(kbuff, len, from) != len)
+            return -EFAULT;
+
+        ret = kstrtoul(kbuff, 0, &brightness);
+        if (ret) {
+            pr_warn_ratelimited("led_write: invalid data, errno %d\n", ret);
+            return len;
+        }
+
+        cmds[0].led = dev->index;
+        cmds[0].op = LED_OP_BRIGHTNESS;
+        cmds[0].value = min_t(unsigned long, brightness, 255);
+        trace_led_write_parsed(dev->index, cmds[0].op, cmds[0].value);
+
+        return led_queue_cmds(dev, cmds, 1) ? len : -EAGAIN;
+    }
+
+    count -= count % sizeof(led_cmd_t);
+    if (count == 0)
+        return -EINVAL;
+
+    while (done < count) {
+        len = min_t(size_t, count - done, sizeof(cmds));
+        copied = copy_from_iter(cmds, len, from);
+        n = copied / sizeof(led_cmd_t);
+
+        for (i = 0; i < n; i++) {
+            cmds[i].led = dev->index;
+            if (!led_cmd_valid(&cmds[i]))
+                break;
+            trace_led_write_parsed(dev->index, cmds[i].op, cmds[i].value);
+        }
+
+        queued = i ? led_queue_cmds(dev, cmds, i) : 0;
+        done += queued * sizeof(led_cmd_t);
+
+        if (queued < n || copied != len)
+            break;
+    }
+
+    if (done)
+        return done;
+
+    if (queued < i)
+        return -EAGAIN;
+    if (i < n)
+        return -EINVAL;
+    return -EFAULT;
+}
+
+static ssize_t led_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    struct led_file *lf = (struct led_file *)iocb->ki_filp->private_data;
+
+    if (iocb->ki_filp->f_flags & O_NONBLOCK)
+        return led_write_queue(lf, from);
+
+    if (lf->format == LED_FORMAT_BINARY)
+        return led_write_records(lf->dev, from);
+
+    return led_write_text(lf->dev, from, &iocb->ki_pos);
+}
+
+
+/*
+ * Serializes batches. Holding it is what lets a batch take any number
+ * of LED locks of the same class, see mutex_lock_nest_lock().
+ */
+static DEFINE_MUTEX(led_batch_mutex);
+
+/*
+ * Apply a whole array of commands. The locks of all LEDs involved are
+ * taken in index order, then every one of them is stopped, gets its
+ * new configuration published and is restarted on one common edge.
+ * Up to LED_MAX locks are too many to try one by one, so with nowait
+ * set a batch fails with -EAGAIN and is retried where it may sleep.
+ */
+static long led_ioctl_batch(const led_ioctl_batch_t *batch, bool nowait)
+{
+    DECLARE_BITMAP(touched, LED_MAX);
+    struct led_dev **devs;
+    struct led_config cfg;
+    struct led_dev *dev;
+    led_cmd_t *cmds;
+    ktime_t edge;
+    long ret = 0;
+    int i, j;
+
+    if (batch->reserved)
+        return -EINVAL;
+
+    if (batch->count == 0)
+        return 0;
+
+    if (batch->count > LED_BATCH_MAX)
+        return -E2BIG;
+
+    if (nowait)
+        return -EAGAIN;
+
+    cmds = memdup_user(u64_to_user_ptr(batch->cmds),
+                       batch->count * sizeof(*cmds));
+    if (IS_ERR(cmds))
+        return PTR_ERR(cmds);
+
+    bitmap_zero(touched, LED_MAX);
+    for (i = 0; i < batch->count; i++) {
+        if (!led_cmd_valid(&cmds[i])) {
+            ret = -EINVAL;
+            goto out;
+        }
+        __set_bit(cmds[i].led, touched);
+    }
+
+    devs = kcalloc(LED_MAX, sizeof(*devs), GFP_KERNEL);
+    if (devs == NULL) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    for_each_set_bit(i, touched, LED_MAX) {
+        devs[i] = led_get(i);
+        if (devs[i] == NULL) {
+            ret = -ENODEV;
+            goto out_put;
+        }
+    }
+
+    if (mutex_lock_interruptible(&led_batch_mutex)) {
+        ret = -ERESTARTSYS;
+        goto out_put;
+    }
+
+    for_each_set_bit(i, touched, LED_MAX) {
+        mutex_lock_nest_lock(&devs[i]->lock, &led_batch_mutex);
+        if (devs[i]->dead) {
+            for_each_set_bit(j, touched, i + 1)
+                mutex_unlock(&devs[j]->lock);
+            ret = -ENODEV;
+            goto out_unlock;
+        }
+    }
+
+    for_each_set_bit(i, touched, LED_MAX)
+        led_engine_stop(devs[i]);
+
+    for (i = 0; i < batch->count; i++) {
+        dev = devs[cmds[i].led];
+        led_config_read(dev, &cfg);
+        if (led_cmd_update(&cfg, &cmds[i]))
+            led_pattern_clear(dev);
+        led_engines[cfg.engine].config(&cfg);
+        led_config_publish(dev, &cfg);
+    }
+
+    /* Far enough ahead that every engine is armed before it passes */
+    edge = ktime_add_us(ktime_get(), LED_BATCH_LEAD_US);
+    for_each_set_bit(i, touched, LED_MAX)
+        led_engine_start(devs[i], edge);
+
+    for_each_set_bit(i, touched, LED_MAX)
+        mutex_unlock(&devs[i]->lock);
+
+out_unlock:
+    mutex_unlock(&led_batch_mutex);
+out_put:
+    for_each_set_bit(i, touched, LED_MAX)
+        if (devs[i])
+            led_put(devs[i]);
+    kfree(devs);
+out:
+    kfree(cmds);
+    return ret;
+}
+
+/*
+ * State of dev as LED_IOCTL_SNAPSHOT reports it.
+ */
+static void led_state_fill(struct led_dev *dev, led_state_t *state)
+{
+    led_ioctl_engine_t info = {0};
+    struct led_config cfg, run;
+    struct led_stats *stats;
+    int frame;
+    int cpu;
+
+    led_config_read(dev, &cfg);
+    led_run_read(dev, &run);
+    led_dev_engine(dev, &run)->info(&run, &info);
+
+    memset(state, 0, sizeof(*state));
+    state->led = dev->index;
+    state->engine = cfg.engine;
+    state->brightness = cfg.brightness;
+    state->generation = cfg.generation;
+    state->applied_engine = run.engine;
+    state->applied = run.brightness;
+    state->applied_generation = run.generation;
+    state->period_ns = info.period_ns;
+    state->on_ns = info.on_ns;
+
+    if (cfg.generation != run.generation)
+        state->flags |= LED_STATE_PENDING;
+
+    if (cfg.dither)
+        state->flags |= LED_STATE_DITHER;
+    if (cfg.relaxed)
+        state->flags |= LED_STATE_RELAXED;
+    if (dev->pwm)
+        state->flags |= LED_STATE_PWM;
+
+    frame = READ_ONCE(dev->pattern_frame);
+    if (frame >= 0) {
+        state->flags |= LED_STATE_PATTERN;
+        state->pattern_frame = frame;
+        state->pattern_repeat = READ_ONCE(dev->pattern_repeat);
+    }
+
+    for_each_possible_cpu(cpu) {
+        stats = per_cpu_ptr(dev->stats, cpu);
+        state->edges += stats->edges;
+        state->missed += stats->missed;
+        state->changes += stats->changes;
+    }
+}
+
+/*
+ * Whether neither the published configuration of dev nor the one its
+ * engine runs has changed since state was filled in.
+ */
+static int led_state_current(struct led_dev *dev, const led_state_t *state)
+{
+    unsigned int seq;
+    u32 generation, applied;
+
+    do {
+        seq = read_seqbegin(&dev->cfg_lock);
+        generation = dev->cfg.generation;
+    } while (read_seqretry(&dev->cfg_lock, seq));
+
+    do {
+        seq = read_seqcount_begin(&dev->run_seq);
+        applied = dev->run.generation;
+    } while (read_seqcount_retry(&dev->run_seq, seq));
+
+    return generation == state->generation &&
+           applied == state->applied_generation;
+}
+
+/*
+ * Collect the state of every LED, then check that no configuration
+ * has been published or picked up by an engine since. If none has,
+ * all of them were what we collected at the moment between the two
+ * passes. Every publish bumps the generation, so this needs no lock
+ * the engines or writers take. led_idr_lock keeps the set of LEDs
+ * fixed meanwhile.
+ */
+static long led_snapshot(led_ioctl_snapshot_t *req)
+{
+    led_state_t *states;
+    struct led_dev *dev;
+    unsigned int n = 0, i, try;
+    long ret = 0;
+    int id;
+
+    states = kcalloc(LED_MAX, sizeof(*states), GFP_KERNEL);
+    if (states == NULL)
+        return -ENOMEM;
+
+    req->flags = 0;
+
+    mutex_lock(&led_idr_lock);
+    for (try = 0; try < LED_SNAPSHOT_TRIES; try++) {
+        n = 0;
+        idr_for_each_entry(&led_idr, dev, id)
+            led_state_fill(dev, &states[n++]);
+
+        req->time_ns = ktime_get_ns();
+
+        i = 0;
+        idr_for_each_entry(&led_idr, dev, id) {
+            if (!led_state_current(dev, &states[i]))
+                break;
+            i++;
+        }
+
+        if (i == n) {
+            req->flags |= LED_SNAPSHOT_CONSISTENT;
+            break;
+        }
+    }
+    mutex_unlock(&led_idr_lock);
+
+    req->total = n;
+    req->filled = min(n, req->count);
+    if (copy_to_user(u64_to_user_ptr(req->states), states,
+                     req->filled * sizeof(*states)))
+        ret = -EFAULT;
+
+    kfree(states);
+    return ret;
+}
+
+
+/*
+ * Carry out ioctl_num with its argument already in kernel memory.
+ * Results for _IOC_READ commands are left in param. With nowait set
+ * fails with -EAGAIN where it would have to wait for a LED lock.
+ */
+static long
+led_ioctl_do(struct led_file *lf, unsigned int ioctl_num,
+             led_ioctl_param_union *param, bool nowait)
+{
+    struct led_dev *dev = lf->dev;
+    int ret = 0;
+
+    switch (ioctl_num) {
+        case LED_ON:
+        case LED_OFF:
+        case LED_TOGGLE:
+        {
+            led_cmd_t cmd = {
+                .op = ioctl_num == LED_ON  ? LED_OP_ON :
+                      ioctl_num == LED_OFF ? LED_OP_OFF : LED_OP_TOGGLE,
+            };
+
+            ret = __led_lock(dev, nowait);
+            if (ret)
+                return ret;
+            led_cmd_apply(dev, &cmd);
+            mutex_unlock(&dev->lock);
+            break;
+        }
+
+        case LED_IOCTL_SET_ENGINE:
+        {
+            led_cmd_t cmd = {
+                .op    = LED_OP_ENGINE,
+                .value = param->engine.engine,
+            };
+
+            if (!led_cmd_valid(&cmd))
+                return -EINVAL;
+
+            ret = __led_lock(dev, nowait);
+            if (ret)
+                return ret;
+            led_cmd_apply(dev, &cmd);
+            mutex_unlock(&dev->lock);
+            break;
+        }
+
+        case LED_IOCTL_GET_ENGINE:
+        {
+            struct led_config cfg;
+
+            led_config_read(dev, &cfg);
+            memset(&param->engine, 0, sizeof(param->engine));
+            param->engine.engine = cfg.engine;
+            led_dev_engine(dev, &cfg)->info(&cfg, &param->engine);
+            break;
+        }
+
+        case LED_IOCTL_BATCH:
+            ret = led_ioctl_batch(&param->batch, nowait);
+            break;
+
+        case LED_IOCTL_SET_PATTERN:
+            ret = led_pattern_set(dev, &param->pattern, nowait);
+            break;
+
+        case LED_IOCTL_SET_FORMAT:
+            if (param->format.format != LED_FORMAT_TEXT &&
+                param->format.format != LED_FORMAT_BINARY)
+                return -EINVAL;
+            lf->format = param->format.format;
+            break;
+
+        case LED_IOCTL_SET_CURVE:
+            /* Waits for RCU readers, so never inline from io_uring */
+            if (nowait)
+                return -EAGAIN;
+            ret = led_curve_upload(&param->curve);
+            break;
+
+        case LED_IOCTL_SNAPSHOT:
+            ret = led_snapshot(&param->snapshot);
+            break;
+
+        case LED_IOCTL_CMD:
+            param->cmd.led = dev->index;
+            if (!led_cmd_valid(&param->cmd))
+                return -EINVAL;
+
+            ret = __led_lock(dev, nowait);
+            if (ret)
+                return ret;
+            led_cmd_apply(dev, &param->cmd);
+            mutex_unlock(&dev->lock);
+            break;
+        
+        default:
+            ret = -EINVAL;
+            break;
+    }                           /* end of switch(ioctl_num) */
+
+    return ret;
+}
+
+static long
+led_ioctl_dispatch(struct file *filp, unsigned int ioctl_num,
+                   unsigned long ioctl_param)
+{
+    struct led_file *lf = (struct led_file *)filp->private_data;
+    int ret = 0;
+    led_ioctl_param_union local_param;
+
+    if (_IOC_SIZE(ioctl_num) > sizeof(local_param))
+        return -EINVAL;
+
+    if ((_IOC_DIR(ioctl_num) & _IOC_WRITE) &&
+        copy_from_user((void *) &local_param, (void __user *) ioctl_param,
+                       _IOC_SIZE(ioctl_num)))
+        return -EFAULT;
+
+    ret = led_ioctl_do(lf, ioctl_num, &local_param, false);
+
+    if (ret == 0 && (_IOC_DIR(ioctl_num) & _IOC_READ) &&
+        copy_to_user((void __user *) ioctl_param, &local_param,
+                     _IOC_SIZE(ioctl_num)))
+        ret = -EFAULT;
+
+    return ret;
+}
+
+static long
+led_ioctl(struct file *filp, unsigned int ioctl_num, unsigned long ioctl_param)
+{
+    struct led_file *lf = (struct led_file *)filp->private_data;
+    long ret;
+
+    trace_led_ioctl_enter(lf->dev->index, ioctl_num);
+    ret = led_ioctl_dispatch(filp, ioctl_num, ioctl_param);
+    trace_led_ioctl_exit(lf->dev->index, ioctl_num, ret);
+
+    return ret;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,19,0)
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,6,0)
+#define led_uring_cmd_arg(ioucmd) io_uring_sqe_cmd((ioucmd)->sqe)
+#else
+#define led_uring_cmd_arg(ioucmd) ((ioucmd)->cmd)
+#endif
+
+/* Room for the argument in the SQE, 16 bytes or 80 on SQE128 rings */
+#define LED_URING_ARG_SIZE        16
+#define LED_URING_ARG_SIZE_SQE128 80
+
+/*
+ * io_uring IORING_OP_URING_CMD. cmd_op is an ioctl number and the SQE
+ * command area holds its argument, see led.h. The first attempt
+ * comes straight from io_uring_enter() and must not sleep on a LED
+ * lock. If one is busy we return -EAGAIN and io_uring issues the
+ * command again from a worker thread, where waiting is fine. The
+ * result is posted as the CQE res.
+ */
+static int led_uring_cmd(struct io_uring_cmd *ioucmd, unsigned int issue_flags)
+{
+    struct led_file *lf = (struct led_file *)ioucmd->file->private_data;
+    unsigned int ioctl_num = ioucmd->cmd_op;
+    size_t size = _IOC_SIZE(ioctl_num);
+    led_ioctl_param_union local_param;
+    long ret;
+
+    /* There is nowhere to copy results to */
+    if (_IOC_TYPE(ioctl_num) != LED_MAGIC || (_IOC_DIR(ioctl_num) & _IOC_READ))
+        return -EINVAL;
+
+    if (size > sizeof(local_param) ||
+        size > (issue_flags & IO_URING_F_SQE128 ?
+                LED_URING_ARG_SIZE_SQE128 : LED_URING_ARG_SIZE))
+        return -EINVAL;
+
+    memcpy(&local_param, led_uring_cmd_arg(ioucmd), size);
+
+    trace_led_ioctl_enter(lf->dev->index, ioctl_num);
+    ret = led_ioctl_do(lf, ioctl_num, &local_param,
+                       issue_flags & IO_URING_F_NONBLOCK);
+    trace_led_ioctl_exit(lf->dev->index, ioctl_num, ret);
+
+    return ret == -ERESTARTSYS ? -EINTR : ret;
+}
+
+#endif
+
+
+
+
+/* 
+ * ==============================================gpio_request_array=
+ *            Proc File Table Interface
+ * ===============================================
+ */
+
+/* 
+ * The type and order of the parameters is standard for a /proc/ read
+ * routine, at least, and possibly for all read routines but we didn't
+ * go and check this assuption yet.
+ *
+ */
+static ssize_t
+led_proc_read(struct file *file,
+              char __user *buffer, size_t buffer_length, loff_t * offset_ptr)
+{
+    char kbuff[512];
+    u64 saved = 0;
+    s64 ms;
+    int cpu, len;
+
+    for_each_possible_cpu(cpu)
+        saved += per_cpu(led_saved, cpu);
+    ms = max_t(s64, ktime_ms_delta(ktime_get(), led_loaded), 1);
+
+    len = scnprintf(kbuff, sizeof(kbuff), "%s: %s\n"
+                    "revision: %s\n"
+                    "author: %s\n"
+                    "licence: %s\n"
+                    "major: %d\n"
+                    "wakeups saved: %llu (%llu/s)\n",
+                    LED_MODULE_NAME, 
+                    MODULE_DESCRIPTION_STR,
+                    MODULE_VERSION_STR, 
+                    MODULE_AUTHOR_STR,
+                    MODULE_LICENSE_STR,
+                    MAJOR(firstdev),
+                    saved, div64_u64(saved * MSEC_PER_SEC, ms));
+
+    return simple_read_from_buffer(buffer, buffer_length, offset_ptr,
+                                   kbuff, len);
+}
+
+
+/*
+ * Map the shared brightness page. It is the same page whichever
+ * /dev/ledN is mapped. Only MAP_SHARED makes sense: stores to a
+ * private copy of the page would never reach the LEDs.
+ */
+static int led_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    int ret;
+
+    if (vma->vm_pgoff != 0 || vma->vm_end - vma->vm_start > PAGE_SIZE)
+        return -EINVAL;
+    if (!(vma->vm_flags & VM_SHARED))
+        return -EINVAL;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,3,0)
+    vm_flags_set(vma, VM_DONTEXPAND | VM_DONTDUMP);
+#else
+    vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+#endif
+
+    ret = vm_insert_page(vma, vma->vm_start, virt_to_page(led_shm));
+    if (ret)
+        return ret;
+
+    vma->vm_ops = &led_shm_vm_ops;
+    if (atomic_inc_return(&led_shm_users) == 1)
+        schedule_work(&led_shm_work);
+
+    return 0;
+}
+
+
+/* 
+ * The file_operations struct is an instance of the standard character
+ * device table entry. We choose to initialize only the open, release,
+ * read, write_iter, poll, mmap, unlock_ioctl and uring_cmd elements
+ * since these are the only functions we use in this module.
+ */
+struct file_operations led_dev_fops = {
+    .owner = THIS_MODULE,
+    .unlocked_ioctl = led_ioctl,
+    .open = led_open,
+    .release = led_close,
+    .read = led_read,
+    .poll = led_poll,
+    .write_iter = led_write_iter,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,19,0)
+    .uring_cmd = led_uring_cmd,
+#endif
+    .mmap = led_mmap,
+};
+
+
+/* 
+ * ===============================================
+ *                Debugfs Interface
+ * ===============================================
+ */
+
+/*
+ * /sys/kernel/debug/led/ has a directory for every LED (ledN) and for
+ * the shared timers of the shared and bcm engines. stats shows the
+ * histograms and counters summed over all CPUs followed by the value
+ * of every CPU, writing anything to reset clears them. LED directories
+ * also have queue, see led_queue_show().
+ */
+static struct dentry *led_debugfs;
+
+static void led_stats_hist_show(struct seq_file *m,
+                                struct led_stats __percpu *stats,
+                                const char *name, size_t offset)
+{
+    u64 total;
+    int cpu, i;
+
+    seq_printf(m, "%s\n%12s %12s", name, "from_ns", "total");
+    for_each_possible_cpu(cpu)
+        seq_printf(m, " %10s%d", "cpu", cpu);
+    seq_putc(m, '\n');
+
+    for (i = 0; i < LED_HIST_BUCKETS; i++) {
+        total = 0;
+        for_each_possible_cpu(cpu)
+            total += ((u64 *)((char *)per_cpu_ptr(stats, cpu) + offset))[i];
+        if (total == 0)
+            continue;
+
+        seq_printf(m, "%12llu %12llu", i ? 1ULL << (i - 1) : 0ULL, total);
+        for_each_possible_cpu(cpu)
+            seq_printf(m, " %11llu",
+                ((u64 *)((char *)per_cpu_ptr(stats, cpu) + offset))[i]);
+        seq_putc(m, '\n');
+    }
+    seq_putc(m, '\n');
+}
+
+static void led_stats_counter_show(struct seq_file *m,
+                                   struct led_stats __percpu *stats,
+                                   const char *name, size_t offset)
+{
+    u64 total = 0;
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+        total += *(u64 *)((char *)per_cpu_ptr(stats, cpu) + offset);
+
+    seq_printf(m, "%-8s %12llu", name, total);
+    for_each_possible_cpu(cpu)
+        seq_printf(m, " %11llu",
+                   *(u64 *)((char *)per_cpu_ptr(stats, cpu) + offset));
+    seq_putc(m, '\n');
+}
+
+static int led_stats_show(struct seq_file *m, void *v)
+{
+    struct led_stats __percpu *stats = m->private;
+
+    led_stats_hist_show(m, stats, "lateness",
+                        offsetof(struct led_stats, lateness));
+    led_stats_hist_show(m, stats, "cost", offsetof(struct led_stats, cost));
+    led_stats_counter_show(m, stats, "edges",
+                           offsetof(struct led_stats, edges));
+    led_stats_counter_show(m, stats, "missed",
+                           offsetof(struct led_stats, missed));
+    led_stats_counter_show(m, stats, "changes",
+                           offsetof(struct led_stats, changes));
+    led_stats_counter_show(m, stats, "saved",
+                           offsetof(struct led_stats, saved));
+    led_stats_counter_show(m, stats, "queued",
+                           offsetof(struct led_stats, queued));
+    led_stats_counter_show(m, stats, "coalesced",
+                           offsetof(struct led_stats, coalesced));
+    led_stats_counter_show(m, stats, "dropped",
+                           offsetof(struct led_stats, dropped));
+    return 0;
+}
+
+static int led_stats_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, led_stats_show, inode->i_private);
+}
+
+static const struct file_operations led_stats_fops = {
+    .owner   = THIS_MODULE,
+    .open    = led_stats_open,
+    .read    = seq_read,
+    .llseek  = seq_lseek,
+    .release = single_release,
+};
+
+static ssize_t led_stats_reset(struct file *file, const char __user *buf,
+                               size_t count, loff_t *ppos)
+{
+    struct led_stats __percpu *stats = file_inode(file)->i_private;
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+        memset(per_cpu_ptr(stats, cpu), 0, sizeof(struct led_stats));
+
+    return count;
+}
+
+static const struct file_operations led_stats_reset_fops = {
+    .owner = THIS_MODULE,
+    .open  = simple_open,
+    .write = led_stats_reset,
+};
+
+/*
+ * ledN/queue shows how many commands the O_NONBLOCK write queue holds
+ * right now, the most it has held at once and its size.
+ */
+static int led_queue_show(struct seq_file *m, void *v)
+{
+    struct led_dev *dev = m->private;
+
+    seq_printf(m, "%-8s %12u\n", "depth", kfifo_len(&dev->queue));
+    seq_printf(m, "%-8s %12u\n", "peak", READ_ONCE(dev->queue_peak));
+    seq_printf(m, "%-8s %12u\n", "size", kfifo_size(&dev->queue));
+    return 0;
+}
 
-#define MODULE_LICENSE_STR      "GPL"
-#define MODULE_DESCRIPTION_STR  "Simple LED module example with procfs and IOCTL"
-#define MODULE_AUTHOR_STR       "Darije Hanzekovic <darije.hanzekovic@gmail.com>"
-#define MODULE_VERSION_STR      "0.1"
+static int led_queue_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, led_queue_show, inode->i_private);
+}
 
+static const struct file_operations led_queue_fops = {
+    .owner   = THIS_MODULE,
+    .open    = led_queue_open,
+    .read    = seq_read,
+    .llseek  = seq_lseek,
+    .release = single_release,
+};
 
-#define BUFFER_SIZE    64
+static struct dentry *led_stats_debugfs(const char *name,
+                                        struct led_stats __percpu *stats)
+{
+    struct dentry *dir = debugfs_create_dir(name, led_debugfs);
 
-#define PWM_PERIOD  25      /* in milliseconds */
-#define PWM_RES     4       /* in bits */
+    debugfs_create_file("stats", S_IRUSR, dir, (void __force *)stats,
+                        &led_stats_fops);
+    debugfs_create_file("reset", S_IWUSR, dir, (void __force *)stats,
+                        &led_stats_reset_fops);
 
-/*
- * Required Proc File-system Struct
- *
- * Used to map entry into proc file table upon module insertion
- */
-static ssize_t led_proc_read(struct file *file,
-        char *buffer,
-        size_t buffer_length, loff_t * offset_ptr);
+    return dir;
+}
 
-struct proc_dir_entry *led_proc_entry;
 
-static const struct file_operations proc_file_fops = {
-    .owner = THIS_MODULE,
-    .read = led_proc_read,
-};
+/* 
+ * ===============================================
+ *                LED instances
+ * ===============================================
+ */
 
 /*
- * * Struct defining pins, direction and inital state
- * */
-static struct gpio leds[] = {
-    { 2, GPIOF_OUT_INIT_LOW, "LED0" },
-    { 3, GPIOF_OUT_INIT_LOW, "LED1" },
-    { 4, GPIOF_OUT_INIT_LOW, "LED2" },
-};
+ * Every LED is also a led_classdev, so the kernel LED triggers can
+ * drive it without a process in between. The class device shares
+ * the configuration with /dev/ledN, the last writer wins either way.
+ * brightness_set_blocking is called from a worker of the LED core and
+ * may take the writer lock like any other writer.
+ */
+static int led_cdev_set(struct led_classdev *cdev, enum led_brightness value)
+{
+    struct led_dev *dev = container_of(cdev, struct led_dev, cdev);
+    int ret;
 
-struct led_dev {
-    unsigned int gpiopin;
-    unsigned int brightness;
-    unsigned int msec_on;
-    unsigned int msec_off;
-    struct timer_list timer;
-    struct semaphore lock;
-    struct cdev cdev;     /* Char device structure      */
-};
+    ret = led_lock(dev);
+    if (ret)
+        return ret;
 
-struct led_dev *led_devices;
+    led_brightness_set(dev, value);
+    mutex_unlock(&dev->lock);
+    return 0;
+}
 
-static dev_t firstdev;
+static enum led_brightness led_cdev_get(struct led_classdev *cdev)
+{
+    struct led_dev *dev = container_of(cdev, struct led_dev, cdev);
+    struct led_config cfg;
 
-//module_param(gpiopins, unsigned int, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
-//MODULE_PARM_DESC(gpiopins, "A list of GPIO pins LEDs are attached to");
+    led_config_read(dev, &cfg);
+    return cfg.brightness;
+}
 
-static void led_timer_start(struct led_dev *dev, int interval)
+static int led_cdev_register(struct led_dev *dev, struct device *parent,
+                             const char *trigger)
 {
-    dev->timer.expires = jiffies + ((interval*HZ)/1000);
-    add_timer(&dev->timer);
+    snprintf(dev->cdev_name, sizeof(dev->cdev_name),
+             LED_MODULE_NAME "%u", dev->index);
+    dev->cdev.name = dev->cdev_name;
+    dev->cdev.max_brightness = 255;
+    dev->cdev.brightness_set_blocking = led_cdev_set;
+    dev->cdev.brightness_get = led_cdev_get;
+    dev->cdev.default_trigger = trigger;
+
+    return led_classdev_register(parent, &dev->cdev);
 }
 
-static void led_timer_stop(struct led_dev *dev)
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,2,0)
+static char *led_devnode(const struct device *dev, umode_t *mode)
+#else
+static char *led_devnode(struct device *dev, umode_t *mode)
+#endif
 {
-    del_timer(&dev->timer);
+    if (mode)
+        *mode = 0664;
+    return NULL;
 }
 
+/*
+ * Channel pwm of the global PWM numbering, what pwms= gives. Kernels
+ * from 6.3 on only hand PWMs out through a lookup by consumer, so
+ * there LEDs with a channel fail to come up.
+ */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,3,0)
+#define led_pwm_request(pwm, label) pwm_request(pwm, label)
+#define led_pwm_free(pwm)           pwm_free(pwm)
+#else
+static struct pwm_device *led_pwm_request(int pwm, const char *label)
+{
+    return ERR_PTR(-EOPNOTSUPP);
+}
+#define led_pwm_free(pwm)           pwm_put(pwm)
+#endif
 
-static void led_timer_toggle_led(unsigned long data)
+/*
+ * Bring up a LED on gpio. It gets the lowest free index and its
+ * /dev/ledN node and LED class device are created right away, the
+ * latter running trigger unless it is NULL.
+ */
+static struct led_dev *led_create(int gpio, int pwm, const char *name,
+                                  unsigned int engine, const char *trigger)
 {
-    int pinval;
-    int delay;
-    struct led_dev *dev = (struct led_dev *)data;
+    struct led_dev *dev;
+    struct device *node;
+    char dirname[16];
+    int res;
 
-    pinval = gpio_get_value(dev->gpiopin);
+    dev = kzalloc(sizeof(*dev), GFP_KERNEL);
+    if (dev == NULL)
+        return ERR_PTR(-ENOMEM);
 
-    delay = pinval ? dev->msec_off : dev->msec_on;
+    dev->stats = alloc_percpu(struct led_stats);
+    if (dev->stats == NULL) {
+        res = -ENOMEM;
+        goto create_stats_fail;
+    }
 
-    gpio_set_value(dev->gpiopin, !pinval);
+    dev->name = kstrdup(name, GFP_KERNEL);
+    if (dev->name == NULL) {
+        res = -ENOMEM;
+        goto create_name_fail;
+    }
 
-    led_timer_start(dev, delay);
-} 
+    if (pwm >= 0) {
+        dev->pwm = led_pwm_request(pwm, dev->name);
+        if (IS_ERR(dev->pwm)) {
+            res = PTR_ERR(dev->pwm);
+            pr_err("Unable to request PWM %d: %d\n", pwm, res);
+            goto create_gpio_fail;
+        }
+    } else {
+        res = gpio_request_one(gpio, GPIOF_OUT_INIT_LOW, dev->name);
+        if (res) {
+            pr_err("Unable to request GPIO %d: %d\n", gpio, res);
+            goto create_gpio_fail;
+        }
+        dev->gpiopin = gpio;
+        dev->desc = gpio_to_desc(dev->gpiopin);
+    }
 
-static void led_timer_init(struct led_dev *dev)
-{
-    init_timer(&dev->timer);
-    dev->timer.data = (unsigned long)dev;
-    dev->timer.function = led_timer_toggle_led;
+    kref_init(&dev->ref);
+    mutex_init(&dev->lock);
+    seqlock_init(&dev->cfg_lock);
+    seqcount_init(&dev->run_seq);
+    init_waitqueue_head(&dev->wait);
+    atomic_set(&dev->events, 0);
+    spin_lock_init(&dev->timer_lock);
+    led_timer_init(dev);
+    led_hrtimer_init(dev);
+    INIT_DELAYED_WORK(&dev->pwm_work, led_pwm_work);
+    spin_lock_init(&dev->queue_lock);
+    INIT_KFIFO(dev->queue);
+    INIT_WORK(&dev->queue_work, led_queue_work);
+    INIT_LIST_HEAD(&dev->engine_node);
+    dev->pattern_frame = -1;
+    dev->cfg.engine = engine;
+    dev->cfg.dither = timer_dither;
+    dev->cfg.relaxed = relaxed;
+    led_engines[dev->cfg.engine].config(&dev->cfg);
+    dev->run = dev->cfg;
+    dev->shm_generation = smp_load_acquire(&led_shm->generation);
+
+    mutex_lock(&led_idr_lock);
+    res = idr_alloc(&led_idr, dev, 0, LED_MAX, GFP_KERNEL);
+    if (res >= 0)
+        dev->index = res;
+    mutex_unlock(&led_idr_lock);
+    if (res < 0)
+        goto create_idr_fail;
+
+    led_shm_publish(dev, &dev->cfg, 1);
+
+    node = device_create(led_class, NULL, MKDEV(MAJOR(firstdev), dev->index),
+                         dev, LED_MODULE_NAME "%u", dev->index);
+    if (IS_ERR(node)) {
+        res = PTR_ERR(node);
+        goto create_node_fail;
+    }
+
+    res = led_cdev_register(dev, node, trigger);
+    if (res)
+        goto create_cdev_fail;
+
+    snprintf(dirname, sizeof(dirname), LED_MODULE_NAME "%u", dev->index);
+    dev->debugfs = led_stats_debugfs(dirname, dev->stats);
+    debugfs_create_file("queue", S_IRUSR, dev->debugfs, dev, &led_queue_fops);
+
+    return dev;
+
+
+create_cdev_fail:
+    device_destroy(led_class, MKDEV(MAJOR(firstdev), dev->index));
+
+create_node_fail:
+    mutex_lock(&led_idr_lock);
+    idr_remove(&led_idr, dev->index);
+    mutex_unlock(&led_idr_lock);
+create_idr_fail:
+    if (dev->pwm)
+        led_pwm_free(dev->pwm);
+    else
+        gpio_free(gpio);
+create_gpio_fail:
+    kfree(dev->name);
+create_name_fail:
+    free_percpu(dev->stats);
+create_stats_fail:
+    kfree(dev);
+    return ERR_PTR(res);
 }
 
-static void led_brightness_set(struct led_dev *dev, int brightness)
+/*
+ * Take dev down. Files still open on it keep their reference, but
+ * every change through them fails with -ENODEV from now on.
+ */
+static void led_destroy(struct led_dev *dev)
 {
-    dev->brightness = (char) (brightness <= 255 ? brightness : 255);
+    mutex_lock(&led_idr_lock);
+    idr_remove(&led_idr, dev->index);
+    mutex_unlock(&led_idr_lock);
 
-    led_timer_stop(dev);
+    /* Turns the LED off through led_cdev_set(), so before dead is set */
+    led_classdev_unregister(&dev->cdev);
+    device_destroy(led_class, MKDEV(MAJOR(firstdev), dev->index));
+    debugfs_remove_recursive(dev->debugfs);
 
-    dev->msec_on = (PWM_PERIOD * brightness ) / 255;
-    dev->msec_off = PWM_PERIOD - dev->msec_on;
-    
-    if (dev->msec_off == 0) {
-        gpio_set_value(dev->gpiopin, 1);
-    } else if (dev->msec_on == 0) {
-        gpio_set_value(dev->gpiopin, 0);
+    mutex_lock(&dev->lock);
+    dev->dead = 1;
+    led_engine_stop(dev);
+    led_pattern_clear(dev);
+    if (dev->pwm) {
+        pwm_disable(dev->pwm);
+        led_pwm_free(dev->pwm);
     } else {
-        led_timer_toggle_led((unsigned long)dev);
+        gpio_set_value(dev->gpiopin, 0);
+        gpio_free(dev->gpiopin);
     }
+    mutex_unlock(&dev->lock);
 
-    pr_info("led_brightness_set: HZ %d, brightness %d, on %d, off %d\n",
-            HZ, dev->brightness, dev->msec_on, dev->msec_off);
+    wake_up_interruptible_poll(&dev->wait, EPOLLHUP);
+    led_put(dev);
 }
 
+static void led_destroy_all(void)
+{
+    struct led_dev *dev;
+    int id;
+
+    idr_for_each_entry(&led_idr, dev, id)
+        led_destroy(dev);
+}
 
-/* 
- * ===============================================
- *                Public Interface
- * ===============================================
- */
 
 /* 
  * ===============================================
- *                IOCTL Interface
+ *                configfs Interface
  * ===============================================
  */
 
 /*
- * Generic open call that will always be successful since there is no
- * extra setup we need to do for this module as far
+ * mkdir /sys/kernel/config/led/<name> makes a new LED instance. It is
+ * set up through its gpio or pwm and engine attributes and brought up
+ * by writing 1 to enable, which creates /dev/ledN, N being shown in
+ * index. rmdir takes it down again.
  */
-static int led_open(struct inode *inode, struct file *filp)
-{
-    struct led_dev *dev;
-
-    dev = container_of(inode->i_cdev, struct led_dev, cdev);
-    filp->private_data = dev;
+struct led_item {
+    struct config_item item;
+    struct mutex lock;
+    int gpio;
+    int pwm;
+    unsigned int engine;
+    bool relaxed;
+    struct led_dev *dev;        /* while enabled */
+};
 
-    return 0;
+static struct led_item *to_led_item(struct config_item *item)
+{
+    return container_of(item, struct led_item, item);
 }
 
-
-static int led_close(struct inode *inode, struct file *filp)
+static ssize_t led_item_gpio_show(struct config_item *item, char *page)
 {
-    return 0;
+    return sprintf(page, "%d\n", to_led_item(item)->gpio);
 }
 
-static ssize_t led_read(struct file *filp, char __user *buff, 
-        size_t count, loff_t *offp)
+static ssize_t led_item_gpio_store(struct config_item *item,
+                                   const char *page, size_t count)
 {
-    struct led_dev *dev = (struct led_dev *)filp->private_data;
-    int len = 0;
-    char kbuff[BUFFER_SIZE];  
-    int retval;
-
-    if (*offp > 0)
-        return 0;
+    struct led_item *li = to_led_item(item);
+    unsigned int gpio;
+    int ret;
 
-    if (down_interruptible(&dev->lock))
-        return -ERESTARTSYS;
+    ret = kstrtouint(page, 0, &gpio);
+    if (ret)
+        return ret;
 
+    if (!gpio_is_valid(gpio))
+        return -EINVAL;
 
-    sprintf(kbuff, "%d\n", dev->brightness);
-    len = strlen(kbuff);
-    if (copy_to_user(buff, kbuff, len)) {
-        retval = -EFAULT;
-        goto out;
-    }
+    mutex_lock(&li->lock);
+    if (li->dev)
+        ret = -EBUSY;
+    else
+        li->gpio = gpio;
+    mutex_unlock(&li->lock);
 
-    *offp += len;
-    retval = len;
+    return ret ? ret : count;
+}
 
-out:
-    up(&dev->lock);
-    return retval;
+static ssize_t led_item_pwm_show(struct config_item *item, char *page)
+{
+    return sprintf(page, "%d\n", to_led_item(item)->pwm);
 }
 
-static ssize_t led_write(struct file *filp, const char __user *buff, 
-                size_t count, loff_t *offp)
-{   
-    struct led_dev *dev = (struct led_dev *)filp->private_data;
-    int len = 0;
-    char kbuff[BUFFER_SIZE] = {0};
-    int retval = 0;
-    unsigned long brightness;
+/* A PWM channel, -1 to drive the LED from its GPIO */
+static ssize_t led_item_pwm_store(struct config_item *item,
+                                  const char *page, size_t count)
+{
+    struct led_item *li = to_led_item(item);
+    int pwm;
     int ret;
 
-    if (down_interruptible(&dev->lock))
-        return -ERESTARTSYS;
+    ret = kstrtoint(page, 0, &pwm);
+    if (ret)
+        return ret;
 
-    len = count < (BUFFER_SIZE-1) ? count : BUFFER_SIZE-1;
+    if (pwm < -1)
+        return -EINVAL;
 
-    if (copy_from_user(kbuff, buff, len)) {
-        retval = -EFAULT;
-        goto out;
-    } 
+    mutex_lock(&li->lock);
+    if (li->dev)
+        ret = -EBUSY;
+    else
+        li->pwm = pwm;
+    mutex_unlock(&li->lock);
 
-    *offp += len;
-    retval = len;
-    kbuff[len] = '\0';
+    return ret ? ret : count;
+}
 
-    if ((ret = kstrtoul(kbuff, 0, &brightness)) == 0) {
-        led_brightness_set(dev, brightness);
-    } else {
-        pr_warn("led_write: invalid data, errno %d\n", ret);
-    }
+static ssize_t led_item_engine_show(struct config_item *item, char *page)
+{
+    return sprintf(page, "%u\n", to_led_item(item)->engine);
+}
 
+static ssize_t led_item_engine_store(struct config_item *item,
+                                     const char *page, size_t count)
+{
+    struct led_item *li = to_led_item(item);
+    led_cmd_t cmd = { .op = LED_OP_ENGINE };
+    int ret;
 
-out:
-    up(&dev->lock);
-    return retval;
-}  
+    ret = kstrtouint(page, 0, &cmd.value);
+    if (ret)
+        return ret;
 
+    if (!led_cmd_valid(&cmd))
+        return -EINVAL;
 
-static long
-led_ioctl(struct file *file, unsigned int ioctl_num, unsigned long ioctl_param)
+    mutex_lock(&li->lock);
+    li->engine = cmd.value;
+    if (li->dev) {
+        ret = led_lock(li->dev);
+        if (ret == 0) {
+            led_cmd_apply(li->dev, &cmd);
+            mutex_unlock(&li->dev->lock);
+        }
+    }
+    mutex_unlock(&li->lock);
+
+    return ret ? ret : count;
+}
+
+static ssize_t led_item_relaxed_show(struct config_item *item, char *page)
 {
-    int ret = 0;
-    led_ioctl_param_union local_param;
+    return sprintf(page, "%d\n", to_led_item(item)->relaxed);
+}
 
-    pr_info("led_ioctl()\n");
+static ssize_t led_item_relaxed_store(struct config_item *item,
+                                      const char *page, size_t count)
+{
+    struct led_item *li = to_led_item(item);
+    led_cmd_t cmd = { .op = LED_OP_PRECISION };
+    bool value;
+    int ret;
 
-    if (copy_from_user
-        ((void *) &local_param, (void *) ioctl_param, _IOC_SIZE(ioctl_num)))
-        return -ENOMEM;
+    ret = kstrtobool(page, &value);
+    if (ret)
+        return ret;
 
-    switch (ioctl_num) {
-        case LED_ON:
-            pr_info("led on\n");
-            break;
-        
-        case LED_OFF:
-            pr_info("led off\n");
+    cmd.value = value ? LED_PRECISION_RELAXED : LED_PRECISION_EXACT;
 
-        case LED_TOGGLE:
-            pr_info("led toggle\n");
-            break;
-        
-        default:
-            pr_err("ioctl: no such command\n");
-            ret = -EINVAL;
-            break;
-    }                           /* end of switch(ioctl_num) */
+    mutex_lock(&li->lock);
+    li->relaxed = value;
+    if (li->dev) {
+        ret = led_lock(li->dev);
+        if (ret == 0) {
+            led_cmd_apply(li->dev, &cmd);
+            mutex_unlock(&li->dev->lock);
+        }
+    }
+    mutex_unlock(&li->lock);
 
+    return ret ? ret : count;
+}
 
-    return ret;
+static ssize_t led_item_enable_show(struct config_item *item, char *page)
+{
+    return sprintf(page, "%d\n", to_led_item(item)->dev != NULL);
 }
 
+static ssize_t led_item_enable_store(struct config_item *item,
+                                     const char *page, size_t count)
+{
+    struct led_item *li = to_led_item(item);
+    struct led_dev *dev;
+    bool enable;
+    int ret;
 
+    ret = kstrtobool(page, &enable);
+    if (ret)
+        return ret;
 
+    mutex_lock(&li->lock);
+    if (enable && li->dev == NULL) {
+        if (li->gpio < 0 && li->pwm < 0) {
+            ret = -EINVAL;
+        } else {
+            dev = led_create(li->gpio, li->pwm, config_item_name(item),
+                             li->engine, NULL);
+            if (IS_ERR(dev)) {
+                ret = PTR_ERR(dev);
+            } else {
+                li->dev = dev;
+                if (li->relaxed != relaxed) {
+                    led_cmd_t cmd = {
+                        .op    = LED_OP_PRECISION,
+                        .value = li->relaxed ? LED_PRECISION_RELAXED :
+                                               LED_PRECISION_EXACT,
+                    };
 
-/* 
- * ==============================================gpio_request_array=
- *            Proc File Table Interface
- * ===============================================
- */
+                    mutex_lock(&dev->lock);
+                    led_cmd_apply(dev, &cmd);
+                    mutex_unlock(&dev->lock);
+                }
+            }
+        }
+    } else if (!enable && li->dev) {
+        led_destroy(li->dev);
+        li->dev = NULL;
+    }
+    mutex_unlock(&li->lock);
 
-/* 
- * The type and order of the parameters is standard for a /proc/ read
- * routine, at least, and possibly for all read routines but we didn't
- * go and check this assuption yet.
- *
- */
-static ssize_t
-led_proc_read(struct file *file,
-              char *buffer, size_t buffer_length, loff_t * offset_ptr)
+    return ret ? ret : count;
+}
+
+static ssize_t led_item_index_show(struct config_item *item, char *page)
 {
-    int ret;
-    int offset = *offset_ptr;
+    struct led_item *li = to_led_item(item);
+    int index;
 
-    pr_info("reading led proc entry (offset=%d; buflen=%d).\n", offset,
-            buffer_length);
+    mutex_lock(&li->lock);
+    index = li->dev ? li->dev->index : -1;
+    mutex_unlock(&li->lock);
 
-    if (offset > 0) {
-        /* we have finished to read, return 0 */
-        ret = 0;
-    } else {
-        sprintf(buffer, "%s: %s\n"
-                "revision: %s\n"
-                "author: %s\n"
-                "licence: %s\n"
-                "major: %d\n", 
-                LED_MODULE_NAME, 
-                MODULE_DESCRIPTION_STR,
-                MODULE_VERSION_STR, 
-                MODULE_AUTHOR_STR,
-                MODULE_LICENSE_STR,
-                MAJOR(firstdev));
+    return sprintf(page, "%d\n", index);
+}
 
-        ret = strlen(buffer);
+CONFIGFS_ATTR(led_item_, gpio);
+CONFIGFS_ATTR(led_item_, pwm);
+CONFIGFS_ATTR(led_item_, engine);
+CONFIGFS_ATTR(led_item_, relaxed);
+CONFIGFS_ATTR(led_item_, enable);
+CONFIGFS_ATTR_RO(led_item_, index);
 
-        *offset_ptr += ret;
-    }
+static struct configfs_attribute *led_item_attrs[] = {
+    &led_item_attr_gpio,
+    &led_item_attr_pwm,
+    &led_item_attr_engine,
+    &led_item_attr_relaxed,
+    &led_item_attr_enable,
+    &led_item_attr_index,
+    NULL,
+};
 
-    return ret;
+static void led_item_release(struct config_item *item)
+{
+    kfree(to_led_item(item));
 }
 
+static struct configfs_item_operations led_item_ops = {
+    .release = led_item_release,
+};
 
-/* 
- * The file_operations struct is an instance of the standard character
- * device table entry. We choose to initialize only the open, release,
- * and unlock_ioctl elements since these are the only functions we use
- * in this module.
- */
-struct file_operations led_dev_fops = {
-    .owner = THIS_MODULE,
-    .unlocked_ioctl = led_ioctl,
-    .open = led_open,
-    .release = led_close,
-    .read = led_read,
-    .write = led_write,
+static struct config_item_type led_item_type = {
+    .ct_item_ops = &led_item_ops,
+    .ct_attrs    = led_item_attrs,
+    .ct_owner    = THIS_MODULE,
 };
 
+static struct config_item *led_group_make_item(struct config_group *group,
+                                               const char *name)
+{
+    struct led_item *li;
 
-/*
- *  * Set up the char_dev structure for this device.
- *   */
-static int led_setup_cdev(struct led_dev *dev, int index)
+    li = kzalloc(sizeof(*li), GFP_KERNEL);
+    if (li == NULL)
+        return ERR_PTR(-ENOMEM);
+
+    mutex_init(&li->lock);
+    li->gpio = -1;
+    li->pwm = -1;
+    li->engine = default_engine;
+    li->relaxed = relaxed;
+    config_item_init_type_name(&li->item, name, &led_item_type);
+
+    return &li->item;
+}
+
+static void led_group_drop_item(struct config_group *group,
+                                struct config_item *item)
 {
-    int err, devno = firstdev + index;
-            
-    sema_init(&dev->lock, 1);
-    led_timer_init(dev);
-    dev->brightness = 0;
-    dev->gpiopin = leds[index].gpio;
-    cdev_init(&dev->cdev, &led_dev_fops);
-    dev->cdev.owner = THIS_MODULE;
-    dev->cdev.ops = &led_dev_fops;
-    err = cdev_add (&dev->cdev, devno, 1);
-    /* Fail gracefully if need be */
-    if (err)
-        pr_err("Error %d adding led%d", err, index);
+    struct led_item *li = to_led_item(item);
+
+    mutex_lock(&li->lock);
+    if (li->dev) {
+        led_destroy(li->dev);
+        li->dev = NULL;
+    }
+    mutex_unlock(&li->lock);
 
-    return err;
+    config_item_put(item);
 }
 
+static struct configfs_group_operations led_group_ops = {
+    .make_item = led_group_make_item,
+    .drop_item = led_group_drop_item,
+};
+
+static struct config_item_type led_group_type = {
+    .ct_group_ops = &led_group_ops,
+    .ct_owner     = THIS_MODULE,
+};
+
+static struct configfs_subsystem led_configfs = {
+    .su_group = {
+        .cg_item = {
+            .ci_namebuf = LED_MODULE_NAME,
+            .ci_type    = &led_group_type,
+        },
+    },
+};
+
 
 /*
  * This gpio_request_arrayroutine is executed when the module is loaded into the
@@ -357,28 +3921,70 @@ static int led_setup_cdev(struct led_dev *dev, int index)
  */
 static int __init led_init(void)
 {
-    int i, j;
+    struct led_dev *dev;
+    char name[16];
+    int i;
     int res = 0;
 
-    res = alloc_chrdev_region(&firstdev, 0, LED_COUNT, LED_MODULE_NAME);
+    if (default_engine >= LED_ENGINE_COUNT || hrperiod_us == 0 ||
+        shared_steps == 0 || bcm_bits == 0 || bcm_bits > 8 ||
+        pwm_period_ns == 0) {
+        pr_err("led: invalid default_engine, hrperiod_us, shared_steps, bcm_bits or pwm_period_ns\n");
+        return -EINVAL;
+    }
+
+    led_loaded = ktime_get();
+    led_timer_calibrate();
+    led_shared_init();
+    led_bcm_init();
+
+    res = led_curve_set(led_curve_builtin);
+    if (res)
+        return res;
+
+    res = led_kthread_init();
+    if (res)
+        goto init_kthread_fail;
+
+    led_queue_wq = alloc_workqueue(LED_MODULE_NAME "_queue", WQ_HIGHPRI, 0);
+    if (led_queue_wq == NULL) {
+        res = -ENOMEM;
+        goto init_wq_alloc_fail;
+    }
+
+    res = alloc_chrdev_region(&firstdev, 0, LED_MAX, LED_MODULE_NAME);
     if (res < 0) {
         pr_warn("led: failed to alloc major\n");
         goto init_major_alloc_fail;
     }
 
-    led_devices = kmalloc(LED_COUNT * sizeof(struct led_dev), GFP_KERNEL);
-    if (led_devices == NULL) {
+    BUILD_BUG_ON(sizeof(led_shm_t) + LED_MAX * sizeof(led_shm_led_t) >
+                 min_t(unsigned long, LED_SHM_SIZE, PAGE_SIZE));
+
+    led_shm = (led_shm_t *)get_zeroed_page(GFP_KERNEL);
+    if (led_shm == NULL) {
         res = -ENOMEM;
-        goto init_dev_alloc_fail;
+        goto init_shm_alloc_fail;
     }
+    led_shm->count = LED_MAX;
 
-    for (i=0; i<LED_COUNT; i++) {
-        if (led_setup_cdev(&led_devices[i], i) != 0) {
-            for (j=0; j<i; j++)
-                cdev_del(&led_devices[j].cdev);
-            res = -ENOMEM;
-            goto init_dev_add_fail;
-        }
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,4,0)
+    led_class = class_create(LED_MODULE_NAME);
+#else
+    led_class = class_create(THIS_MODULE, LED_MODULE_NAME);
+#endif
+    if (IS_ERR(led_class)) {
+        res = PTR_ERR(led_class);
+        goto init_class_create_fail;
+    }
+    led_class->devnode = led_devnode;
+
+    cdev_init(&led_cdev, &led_dev_fops);
+    led_cdev.owner = THIS_MODULE;
+    res = cdev_add(&led_cdev, firstdev, LED_MAX);
+    if (res) {
+        pr_err("Error %d adding led devices", res);
+        goto init_dev_add_fail;
     }
 
     /* 
@@ -400,12 +4006,28 @@ static int __init led_init(void)
         goto init_proc_create_fail;
     }
 
-    // register gpios
-    res = gpio_request_array(leds, ARRAY_SIZE(leds));
+    led_debugfs = debugfs_create_dir(LED_MODULE_NAME, NULL);
+    led_stats_debugfs("shared", &led_shared_stats);
+    led_stats_debugfs("bcm", &led_bcm_stats);
+
+    // LEDs given at load time
+    for (i = 0; i < ngpiopins; i++) {
+        snprintf(name, sizeof(name), "LED%d", i);
+        dev = led_create(gpiopins[i], i < npwms ? pwms[i] : -1, name,
+                         default_engine, i < ntriggers ? triggers[i] : NULL);
+        if (IS_ERR(dev)) {
+            res = PTR_ERR(dev);
+            goto init_gpio_alloc_fail;
+        }
+    }
+
+    config_group_init(&led_configfs.su_group);
+    mutex_init(&led_configfs.su_mutex);
+    res = configfs_register_subsystem(&led_configfs);
     if (res) {
-        pr_err("Unable to request GPIOs: %d\n", res);
+        pr_err("Unable to register configfs subsystem: %d\n", res);
         goto init_gpio_alloc_fail;
-    }   
+    }
 
     pr_info("led module installed from proc=%s with pid=%d\n",
             current->comm, current->pid);
@@ -414,32 +4036,57 @@ static int __init led_init(void)
 
 
 init_gpio_alloc_fail:
+    flush_work(&led_shm_work);
+    led_destroy_all();
+    led_shared_exit();
+    led_bcm_exit();
+    debugfs_remove_recursive(led_debugfs);
     remove_proc_entry(LED_MODULE_NAME, NULL);
 init_proc_create_fail:
-    for (i=0; i<LED_COUNT; i++)
-        cdev_del(&led_devices[i].cdev);
+    cdev_del(&led_cdev);
 init_dev_add_fail:
-    kfree(led_devices);
-init_dev_alloc_fail:
-    unregister_chrdev_region(firstdev, LED_COUNT);
+    class_destroy(led_class);
+init_class_create_fail:
+    free_page((unsigned long)led_shm);
+init_shm_alloc_fail:
+    unregister_chrdev_region(firstdev, LED_MAX);
 init_major_alloc_fail:
+    destroy_workqueue(led_queue_wq);
+init_wq_alloc_fail:
+    led_kthread_exit();
+init_kthread_fail:
+    led_curve_exit();
     return res;
 }
 
+/*
+ * configfs instances pin the module, so only the LEDs given at load
+ * time are left here.
+ */
 static void __exit led_exit(void)
 {
-    int i;
-
-    gpio_free_array(leds, ARRAY_SIZE(leds));
+    configfs_unregister_subsystem(&led_configfs);
 
     remove_proc_entry(LED_MODULE_NAME, NULL);
 
-    for (i=0; i<LED_COUNT; i++) {
-        led_timer_stop(&led_devices[i]);
-        cdev_del(&led_devices[i].cdev);
-    }
+    cdev_del(&led_cdev);
+    flush_work(&led_shm_work);
+    led_destroy_all();
+    debugfs_remove_recursive(led_debugfs);
+
+    /* Queues of closed files may still be draining */
+    destroy_workqueue(led_queue_wq);
+
+    led_shared_exit();
+    led_bcm_exit();
+    led_kthread_exit();
+
+    class_destroy(led_class);
+    idr_destroy(&led_idr);
+    free_page((unsigned long)led_shm);
 
-    unregister_chrdev_region(firstdev, LED_COUNT);
+    unregister_chrdev_region(firstdev, LED_MAX);
+    led_curve_exit();
 
     pr_info("led module uninstalled from proc=%s with pid=%d\n",
             current->comm, current->pid);
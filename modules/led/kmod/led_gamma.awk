@@ -0,0 +1,55 @@
+#!/usr/bin/awk -f
+#
+# Generates led_gamma.h, the brightness curve the led module starts
+# with: the duty cycle for each of the 256 brightness levels in
+# units of 1/LED_DUTY_ONE.
+#
+#   awk -v curve=gamma -v gamma=2.2 -f led_gamma.awk > led_gamma.h
+#
+# curve is one of
+#   gamma   - (brightness / 255) ^ gamma, gamma defaults to 2.2
+#   cie     - CIE 1976 lightness, perceptually even steps
+#   linear  - duty proportional to brightness
+#
+BEGIN {
+	one = 65536
+
+	if (curve == "")
+		curve = "gamma"
+	if (gamma == "")
+		gamma = 2.2
+
+	if (curve == "gamma")
+		name = "gamma " gamma
+	else if (curve == "cie" || curve == "linear")
+		name = curve
+	else {
+		print "led_gamma.awk: unknown curve " curve > "/dev/stderr"
+		exit 1
+	}
+
+	print "/* Generated by led_gamma.awk, do not edit */"
+	print ""
+	printf "#define LED_CURVE_BUILTIN_NAME \"%s\"\n", name
+	print ""
+	print "static const u32 led_curve_builtin[LED_CURVE_SIZE] = {"
+
+	for (i = 0; i < 256; i++) {
+		x = i / 255
+		if (curve == "gamma")
+			y = x ^ gamma
+		else if (curve == "cie") {
+			l = 100 * x
+			y = l <= 8 ? l / 903.3 : ((l + 16) / 116) ^ 3
+		} else
+			y = x
+
+		line = line sprintf(" %5d,", int(y * one + 0.5))
+		if (i % 8 == 7) {
+			print "   " line
+			line = ""
+		}
+	}
+
+	print "};"
+}
@@ -1,23 +1,47 @@
 #!/bin/sh
 module="led"
 device="led"
-mode="664"
 
 # invoke insmod with all arguments we got
 # and use a pathname, as newer modutils don't look in . by default
+# e.g. ./led_load.sh gpiopins=2,3,4
 /sbin/insmod ./$module.ko $* || exit 1
 
-# remove stale nodes
-rm -f /dev/${device}[0-2]
-major=$(awk "\$2 == \"$module\" {print \$1}" /proc/devices)
-mknod /dev/${device}0 c $major 0
-mknod /dev/${device}1 c $major 1
-mknod /dev/${device}2 c $major 2
-
-# give appropriate group/permissions, and change the group.
-# Not all distributions have staff, some have "wheel" instead.
-#group="staff"
-#grep -q '^staff:' /etc/group || group="wheel"
-#chgrp $group /dev/${device}[0-3]
-chmod $mode /dev/${device}[0-2]
-
+# /dev/${device}N nodes (mode 664) are created by the module, one per
+# LED. More LEDs can be added at runtime through configfs:
+#
+#   mkdir /sys/kernel/config/led/status
+#   echo 17 > /sys/kernel/config/led/status/gpio
+#   echo 1 > /sys/kernel/config/led/status/enable
+#   cat /sys/kernel/config/led/status/index
+#
+# LEDs can be driven by a hardware PWM channel instead of a GPIO. The
+# channels are global PWM numbers, one per LED in gpiopins order, and
+# LEDs without one keep their GPIO. Without PWM hardware the
+# led_pwm_mock module provides channels to try this with:
+#
+#   /sbin/insmod ./led_pwm_mock.ko
+#   ./led_load.sh gpiopins=2,3 pwms=<base>,-1
+#   echo <base+1> > /sys/kernel/config/led/status/pwm
+#
+# Every LED is also registered with the LED class, so kernel triggers
+# can drive it directly:
+#
+#   ./led_load.sh gpiopins=2,3 triggers=heartbeat,disk-activity
+#   echo netdev > /sys/class/leds/led1/trigger
+#
+# The kthread engine (4) runs the PWM schedule from a SCHED_FIFO
+# thread, which can be kept on an isolated CPU. The per-LED lateness
+# histograms in /sys/kernel/debug/led/ledN/stats compare it with the
+# hrtimer engine (1):
+#
+#   ./led_load.sh default_engine=4 kthread_cpu=3
+#   echo 2 > /sys/module/led/parameters/kthread_cpu
+#
+# Status LEDs that only blink slowly can run with relaxed precision
+# (LED_OP_PRECISION), so their edges wait up to relaxed_slack_us for
+# other wakeups instead of waking an idle CPU. /proc/led shows the
+# wakeups saved:
+#
+#   ./led_load.sh relaxed=1 relaxed_slack_us=50000
+#   echo 1 > /sys/kernel/config/led/status/relaxed
@@ -0,0 +1,86 @@
+/*
+ * led_pwm_mock.c - PWM controller without hardware
+ *
+ * Registers a pwm_chip whose channels just remember the state they
+ * were given, so the hardware PWM path of the led module can be
+ * exercised on machines without PWM channels:
+ *
+ *   insmod led_pwm_mock.ko npwm=4
+ *   dmesg | grep led_pwm_mock         # base of the channels
+ *   insmod led.ko gpiopins=2,3 pwms=<base>,<base+1>
+ *
+ * The state of every channel shows in /sys/kernel/debug/pwm.
+ */
+#include <linux/device.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/platform_device.h>
+#include <linux/pwm.h>
+
+#define LED_PWM_MOCK_NAME "led_pwm_mock"
+
+static unsigned int npwm = 4;
+module_param(npwm, uint, S_IRUGO);
+MODULE_PARM_DESC(npwm, "Number of PWM channels");
+
+static struct platform_device *led_pwm_mock_pdev;
+static struct pwm_chip led_pwm_mock_chip;
+
+/*
+ * Accept whatever we are asked for. The core keeps the state, so
+ * there is nothing to store here.
+ */
+static int led_pwm_mock_apply(struct pwm_chip *chip, struct pwm_device *pwm,
+                              const struct pwm_state *state)
+{
+    dev_dbg(chip->dev, "pwm%u: period %llu duty %llu %s\n", pwm->hwpwm,
+            state->period, state->duty_cycle,
+            state->enabled ? "enabled" : "disabled");
+    return 0;
+}
+
+static const struct pwm_ops led_pwm_mock_ops = {
+    .apply = led_pwm_mock_apply,
+    .owner = THIS_MODULE,
+};
+
+static int __init led_pwm_mock_init(void)
+{
+    int res;
+
+    if (npwm == 0)
+        return -EINVAL;
+
+    led_pwm_mock_pdev = platform_device_register_simple(LED_PWM_MOCK_NAME,
+                                                        -1, NULL, 0);
+    if (IS_ERR(led_pwm_mock_pdev))
+        return PTR_ERR(led_pwm_mock_pdev);
+
+    led_pwm_mock_chip.dev = &led_pwm_mock_pdev->dev;
+    led_pwm_mock_chip.ops = &led_pwm_mock_ops;
+    led_pwm_mock_chip.base = -1;
+    led_pwm_mock_chip.npwm = npwm;
+
+    res = pwmchip_add(&led_pwm_mock_chip);
+    if (res) {
+        platform_device_unregister(led_pwm_mock_pdev);
+        return res;
+    }
+
+    pr_info(LED_PWM_MOCK_NAME ": %u channels from base %d\n",
+            npwm, led_pwm_mock_chip.base);
+    return 0;
+}
+
+static void __exit led_pwm_mock_exit(void)
+{
+    pwmchip_remove(&led_pwm_mock_chip);
+    platform_device_unregister(led_pwm_mock_pdev);
+}
+
+module_init(led_pwm_mock_init);
+module_exit(led_pwm_mock_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("PWM controller without hardware for testing the led module");
+MODULE_AUTHOR("Darije Hanzekovic");
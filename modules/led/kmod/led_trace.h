@@ -0,0 +1,152 @@
+/*
+ * led_trace.h - Tracepoints of the led kmod
+ *
+ * Nothing is logged unless the events are enabled, e.g.
+ *
+ *   echo 1 > /sys/kernel/debug/tracing/events/led/enable
+ *   cat /sys/kernel/debug/tracing/trace_pipe
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM led
+
+#if !defined(_LED_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _LED_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/ktime.h>
+
+TRACE_EVENT(led_ioctl_enter,
+
+    TP_PROTO(unsigned int index, unsigned int cmd),
+
+    TP_ARGS(index, cmd),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, index)
+        __field(unsigned int, cmd)
+    ),
+
+    TP_fast_assign(
+        __entry->index = index;
+        __entry->cmd   = cmd;
+    ),
+
+    TP_printk("led%u cmd=0x%x", __entry->index, __entry->cmd)
+);
+
+TRACE_EVENT(led_ioctl_exit,
+
+    TP_PROTO(unsigned int index, unsigned int cmd, long ret),
+
+    TP_ARGS(index, cmd, ret),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, index)
+        __field(unsigned int, cmd)
+        __field(long, ret)
+    ),
+
+    TP_fast_assign(
+        __entry->index = index;
+        __entry->cmd   = cmd;
+        __entry->ret   = ret;
+    ),
+
+    TP_printk("led%u cmd=0x%x ret=%ld", __entry->index, __entry->cmd,
+              __entry->ret)
+);
+
+/*
+ * A command parsed out of write(), text writes show up as
+ * LED_OP_BRIGHTNESS.
+ */
+TRACE_EVENT(led_write_parsed,
+
+    TP_PROTO(unsigned int index, unsigned int op, unsigned int value),
+
+    TP_ARGS(index, op, value),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, index)
+        __field(unsigned int, op)
+        __field(unsigned int, value)
+    ),
+
+    TP_fast_assign(
+        __entry->index = index;
+        __entry->op    = op;
+        __entry->value = value;
+    ),
+
+    TP_printk("led%u op=%u value=%u", __entry->index, __entry->op,
+              __entry->value)
+);
+
+/*
+ * An engine starts running a new configuration, either because it was
+ * restarted or because it picked the configuration up at the start of
+ * a period.
+ */
+TRACE_EVENT(led_brightness_applied,
+
+    TP_PROTO(unsigned int index, unsigned int engine,
+             unsigned int brightness, u32 generation),
+
+    TP_ARGS(index, engine, brightness, generation),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, index)
+        __field(unsigned int, engine)
+        __field(unsigned int, brightness)
+        __field(u32, generation)
+    ),
+
+    TP_fast_assign(
+        __entry->index      = index;
+        __entry->engine     = engine;
+        __entry->brightness = brightness;
+        __entry->generation = generation;
+    ),
+
+    TP_printk("led%u engine=%u brightness=%u generation=%u",
+              __entry->index, __entry->engine, __entry->brightness,
+              __entry->generation)
+);
+
+/*
+ * An engine timer went off. index is -1 for the timers the shared and
+ * bcm engines run for all of their LEDs.
+ */
+TRACE_EVENT(led_timer_fired,
+
+    TP_PROTO(int index, unsigned int engine, ktime_t scheduled, ktime_t now),
+
+    TP_ARGS(index, engine, scheduled, now),
+
+    TP_STRUCT__entry(
+        __field(int, index)
+        __field(unsigned int, engine)
+        __field(s64, scheduled)
+        __field(s64, now)
+    ),
+
+    TP_fast_assign(
+        __entry->index     = index;
+        __entry->engine    = engine;
+        __entry->scheduled = ktime_to_ns(scheduled);
+        __entry->now       = ktime_to_ns(now);
+    ),
+
+    TP_printk("led%d engine=%u scheduled=%lld late=%lldns",
+              __entry->index, __entry->engine, __entry->scheduled,
+              __entry->now - __entry->scheduled)
+);
+
+#endif /* _LED_TRACE_H */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE led_trace
+#include <trace/define_trace.h>
@@ -1,3 +1,8 @@
 #!/bin/sh
 
-sudo rmmod led.ko && sudo rm -f /dev/led[0,1,2]
+# LEDs created through configfs keep the module in use
+for led in /sys/kernel/config/led/*/; do
+    [ -d "$led" ] && sudo rmdir "$led"
+done
+
+sudo rmmod led.ko
@@ -0,0 +1,380 @@
+/*
+ * ddal_led.cpp - Userspace library for the led kmod
+ *
+ */
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <system_error>
+
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include <ddal_led.h>
+#include <ddal_led.hpp>
+
+namespace ddal {
+
+namespace sys {
+
+[[noreturn]] static void
+fail(const char *what)
+{
+	throw std::system_error(errno, std::generic_category(), what);
+}
+
+int
+open(led_id id)
+{
+	char path[32];
+	int fd;
+
+	std::snprintf(path, sizeof(path), DDAL_LED_DEV_PATH "%u", id.index());
+	fd = ::open(path, O_RDWR | O_CLOEXEC);
+	if (fd < 0)
+		fail(path);
+
+	return fd;
+}
+
+void
+close(int fd)
+{
+	if (::close(fd) < 0)
+		fail("close");
+}
+
+void
+ioctl(int fd, unsigned long request, void *arg)
+{
+	if (::ioctl(fd, request, arg) < 0)
+		fail("ioctl");
+}
+
+void
+apply(int fd, const led_cmd_t &cmd)
+{
+	led_cmd_t arg = cmd;
+
+	ioctl(fd, LED_IOCTL_CMD, &arg);
+}
+
+void
+batch(int fd, const led_cmd_t *cmds, std::size_t count)
+{
+	led_ioctl_batch_t batch = {};
+
+	while (count) {
+		batch.cmds = reinterpret_cast<unsigned long>(cmds);
+		batch.count = std::min<std::size_t>(count, LED_BATCH_MAX);
+		ioctl(fd, LED_IOCTL_BATCH, &batch);
+		cmds += batch.count;
+		count -= batch.count;
+	}
+}
+
+void
+set_brightness(int fd, unsigned int brightness)
+{
+	char buf[16];
+	int len;
+
+	len = std::snprintf(buf, sizeof(buf), "%u", brightness);
+	if (::write(fd, buf, len) != len)
+		fail("write");
+}
+
+unsigned int
+get_brightness(int fd)
+{
+	char buf[16];
+	ssize_t len;
+
+	len = ::pread(fd, buf, sizeof(buf) - 1, 0);
+	if (len < 0)
+		fail("read");
+
+	buf[len] = '\0';
+	return std::strtoul(buf, nullptr, 10);
+}
+
+} // namespace sys
+
+
+led::led(led_id id)
+	: id_(id), fd_(sys::open(id))
+{
+}
+
+led::~led()
+{
+	if (fd_ >= 0)
+		::close(fd_);
+}
+
+led::led(led &&other) noexcept
+	: id_(other.id_), fd_(other.release())
+{
+}
+
+led &
+led::operator=(led &&other) noexcept
+{
+	if (this != &other) {
+		if (fd_ >= 0)
+			::close(fd_);
+		id_ = other.id_;
+		fd_ = other.release();
+	}
+	return *this;
+}
+
+int
+led::release() noexcept
+{
+	int fd = fd_;
+
+	fd_ = -1;
+	return fd;
+}
+
+void
+led::on()
+{
+	sys::ioctl(fd_, LED_ON);
+}
+
+void
+led::off()
+{
+	sys::ioctl(fd_, LED_OFF);
+}
+
+void
+led::toggle()
+{
+	sys::ioctl(fd_, LED_TOGGLE);
+}
+
+void
+led::brightness(unsigned int value)
+{
+	if (value > 255)
+		throw std::out_of_range("brightness out of range");
+
+	sys::set_brightness(fd_, value);
+}
+
+unsigned int
+led::brightness() const
+{
+	return sys::get_brightness(fd_);
+}
+
+void
+led::engine(unsigned int engine)
+{
+	led_ioctl_engine_t arg = {};
+
+	if (engine >= LED_ENGINE_COUNT)
+		throw std::out_of_range("unknown engine");
+
+	arg.engine = engine;
+	sys::ioctl(fd_, LED_IOCTL_SET_ENGINE, &arg);
+}
+
+led_ioctl_engine_t
+led::engine_info() const
+{
+	led_ioctl_engine_t arg = {};
+
+	sys::ioctl(fd_, LED_IOCTL_GET_ENGINE, &arg);
+	return arg;
+}
+
+void
+led::apply(const led_cmd_t &cmd)
+{
+	sys::apply(fd_, cmd);
+}
+
+std::vector<led_state_t>
+led::snapshot(bool *consistent) const
+{
+	std::vector<led_state_t> states(LED_MAX);
+	led_ioctl_snapshot_t arg = {};
+
+	arg.states = reinterpret_cast<unsigned long>(states.data());
+	arg.count = states.size();
+	sys::ioctl(fd_, LED_IOCTL_SNAPSHOT, &arg);
+
+	states.resize(arg.filled);
+	if (consistent)
+		*consistent = arg.flags & LED_SNAPSHOT_CONSISTENT;
+
+	return states;
+}
+
+
+led &
+led_cache::get(led_id id)
+{
+	std::unique_ptr<led> &slot = leds_[id.index()];
+
+	if (!slot)
+		slot.reset(new led(id));
+
+	return *slot;
+}
+
+void
+led_cache::close(led_id id)
+{
+	leds_[id.index()].reset();
+}
+
+void
+led_cache::clear()
+{
+	for (auto &slot : leds_)
+		slot.reset();
+}
+
+led *
+led_cache::any()
+{
+	for (auto &slot : leds_)
+		if (slot)
+			return slot.get();
+
+	return nullptr;
+}
+
+
+transaction::transaction(led_cache &cache)
+	: cache_(cache)
+{
+	level_.fill(none);
+}
+
+/*
+ * Brightness, on, off and toggle all end up as the brightness of the
+ * LED, only the last one matters unless it is a toggle. A toggle
+ * after a known brightness is that brightness inverted. A toggle after
+ * a toggle is kept: the kernel toggles to 0 or 255, so two of them
+ * take a LED at 100 to 255, which no single command says here.
+ */
+transaction &
+transaction::add(led_id id, unsigned int op, unsigned int value)
+{
+	int &slot = level_[id.index()];
+	led_cmd_t cmd = {};
+
+	cmd.led = id.index();
+	cmd.op = op;
+	cmd.value = value;
+
+	if (op == LED_OP_BRIGHTNESS || op == LED_OP_ON || op == LED_OP_OFF ||
+	    op == LED_OP_TOGGLE) {
+		if (slot != none && (op != LED_OP_TOGGLE ||
+				     cmds_[slot].op != LED_OP_TOGGLE)) {
+			led_cmd_t &prev = cmds_[slot];
+
+			if (op != LED_OP_TOGGLE) {
+				prev = cmd;
+			} else {
+				bool lit = prev.op == LED_OP_ON ||
+					   (prev.op == LED_OP_BRIGHTNESS && prev.value);
+
+				prev.op = LED_OP_BRIGHTNESS;
+				prev.value = lit ? 0 : 255;
+			}
+			return *this;
+		}
+		slot = cmds_.size();
+	}
+
+	cmds_.push_back(cmd);
+	return *this;
+}
+
+transaction &
+transaction::on(led_id id)
+{
+	return add(id, LED_OP_ON, 0);
+}
+
+transaction &
+transaction::off(led_id id)
+{
+	return add(id, LED_OP_OFF, 0);
+}
+
+transaction &
+transaction::toggle(led_id id)
+{
+	return add(id, LED_OP_TOGGLE, 0);
+}
+
+transaction &
+transaction::brightness(led_id id, unsigned int value)
+{
+	if (value > 255)
+		throw std::out_of_range("brightness out of range");
+
+	return add(id, LED_OP_BRIGHTNESS, value);
+}
+
+transaction &
+transaction::engine(led_id id, unsigned int engine)
+{
+	if (engine >= LED_ENGINE_COUNT)
+		throw std::out_of_range("unknown engine");
+
+	return add(id, LED_OP_ENGINE, engine);
+}
+
+transaction &
+transaction::dither(led_id id, bool enable)
+{
+	return add(id, LED_OP_DITHER, enable);
+}
+
+transaction &
+transaction::relaxed(led_id id, bool enable)
+{
+	return add(id, LED_OP_PRECISION,
+		   enable ? LED_PRECISION_RELAXED : LED_PRECISION_EXACT);
+}
+
+/*
+ * The batch ioctl takes commands for any LED through any /dev/ledN,
+ * so it goes through whichever LED is open already, or the first one
+ * of the transaction.
+ */
+void
+transaction::commit()
+{
+	led *dev;
+
+	if (cmds_.empty())
+		return;
+
+	dev = cache_.any();
+	if (dev == nullptr)
+		dev = &cache_.get(led_id(cmds_.front().led));
+
+	sys::batch(dev->fd(), cmds_.data(), cmds_.size());
+	clear();
+}
+
+void
+transaction::clear()
+{
+	cmds_.clear();
+	level_.fill(none);
+}
+
+} // namespace ddal
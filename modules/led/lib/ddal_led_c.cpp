@@ -0,0 +1,84 @@
+/*
+ * ddal_led_c.cpp - C interface of the led library, see ddal_led.h
+ *
+ */
+#include <cerrno>
+#include <new>
+#include <stdexcept>
+#include <system_error>
+
+#include <ddal_led.h>
+#include <ddal_led.hpp>
+
+/*
+ * Run f, turning exceptions into -1 and errno like a system call
+ * would.
+ */
+template <typename F>
+static int
+ddal_led_call(F f)
+{
+	try {
+		return f();
+	} catch (const std::system_error &e) {
+		errno = e.code().value();
+	} catch (const std::out_of_range &) {
+		errno = EINVAL;
+	} catch (const std::bad_alloc &) {
+		errno = ENOMEM;
+	}
+	return -1;
+}
+
+extern "C" {
+
+int
+ddal_led_open(unsigned int index)
+{
+	return ddal_led_call([=] {
+		return ddal::sys::open(ddal::led_id(index));
+	});
+}
+
+int
+ddal_led_close(int fd)
+{
+	return ddal_led_call([=] { ddal::sys::close(fd); return 0; });
+}
+
+int
+ddal_led_on(int fd)
+{
+	return ddal_led_call([=] { ddal::sys::ioctl(fd, LED_ON); return 0; });
+}
+
+int
+ddal_led_off(int fd)
+{
+	return ddal_led_call([=] { ddal::sys::ioctl(fd, LED_OFF); return 0; });
+}
+
+int
+ddal_led_toggle(int fd)
+{
+	return ddal_led_call([=] { ddal::sys::ioctl(fd, LED_TOGGLE); return 0; });
+}
+
+int
+ddal_led_set_brightness(int fd, unsigned int brightness)
+{
+	return ddal_led_call([=] {
+		ddal::sys::set_brightness(fd, brightness);
+		return 0;
+	});
+}
+
+int
+ddal_led_get_brightness(int fd)
+{
+	return ddal_led_call([=] {
+		return static_cast<int>(ddal::sys::get_brightness(fd));
+	});
+}
+
+} /* extern "C" */
@@ -0,0 +1,92 @@
+/*
+ * Checks that folding in ddal::transaction leaves a LED where sending
+ * every command on its own would. The kernel side is modelled after
+ * led_cmd_update() in kmod/led.c.
+ */
+#include <cstdio>
+#include <functional>
+#include <initializer_list>
+
+#include <ddal_led.hpp>
+
+static unsigned int
+apply(unsigned int brightness, const led_cmd_t &cmd)
+{
+	switch (cmd.op) {
+	case LED_OP_BRIGHTNESS:
+		return cmd.value > 255 ? 255 : cmd.value;
+	case LED_OP_ON:
+		return 255;
+	case LED_OP_OFF:
+		return 0;
+	case LED_OP_TOGGLE:
+		return brightness ? 0 : 255;
+	}
+	return brightness;
+}
+
+static int failed;
+
+static void
+check(const char *name, unsigned int start,
+      std::function<void(ddal::transaction &, ddal::led_id)> build,
+      unsigned int expect)
+{
+	ddal::led_cache cache;
+	ddal::transaction t(cache);
+	ddal::led_id id{0};
+	unsigned int brightness = start;
+
+	build(t, id);
+	for (const led_cmd_t &cmd : t.commands())
+		brightness = apply(brightness, cmd);
+
+	if (brightness != expect) {
+		std::printf("FAIL %s: from %u got %u, expected %u\n",
+			    name, start, brightness, expect);
+		failed++;
+	}
+}
+
+int
+main()
+{
+	for (unsigned int start : {0u, 100u, 255u})
+		check("toggle toggle", start,
+		      [](ddal::transaction &t, ddal::led_id id) {
+			      t.toggle(id).toggle(id);
+		      },
+		      start ? 255 : 0);
+
+	check("brightness toggle toggle", 0,
+	      [](ddal::transaction &t, ddal::led_id id) {
+		      t.brightness(id, 100).toggle(id).toggle(id);
+	      },
+	      255);
+
+	check("brightness toggle", 255,
+	      [](ddal::transaction &t, ddal::led_id id) {
+		      t.brightness(id, 100).toggle(id);
+	      },
+	      0);
+
+	check("off toggle", 255,
+	      [](ddal::transaction &t, ddal::led_id id) {
+		      t.off(id).toggle(id);
+	      },
+	      255);
+
+	check("toggle toggle brightness", 0,
+	      [](ddal::transaction &t, ddal::led_id id) {
+		      t.toggle(id).toggle(id).brightness(id, 40);
+	      },
+	      40);
+
+	check("toggle on", 0,
+	      [](ddal::transaction &t, ddal::led_id id) {
+		      t.toggle(id).on(id);
+	      },
+	      255);
+
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,533 @@
+/*
+ * ledbench.c - Measure the led device interfaces
+ *
+ * Every path is run with 1 up to --threads threads. With devices
+ * "same" all threads drive /dev/led0, with "different" thread i
+ * drives the i-th LED found, wrapping around. One CSV line is printed
+ * per path, device mode and thread count with the throughput and
+ * latency percentiles in nanoseconds.
+ *
+ * Paths that carry several commands per call count every command as
+ * an operation and report the latency of a call divided by the
+ * number of commands it carried.
+ *
+ * ledbench [--threads=N] [--ops=N] [--path=NAME] [--devices=same|different]
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/io_uring.h>
+#include <linux/led.h>
+#include <ddal_led.h>
+
+/* IORING_OP_URING_CMD came with the same headers as SQE128 */
+#ifdef IORING_SETUP_SQE128
+#define BENCH_URING
+#define BENCH_URING_DEPTH 32
+
+struct bench_uring {
+	int fd;
+	void *sq_ring, *cq_ring;
+	size_t sq_size, cq_size;
+	unsigned int *sq_tail, *sq_mask, *sq_array;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+};
+#endif
+
+struct bench_thread {
+	pthread_t thread;
+	pthread_barrier_t *start;
+	const struct bench_path *path;
+	unsigned int led;
+	int fd;
+	long ops;
+	unsigned long long *lat;   /* ns per operation */
+	unsigned long long begin, end;
+	int err;
+	unsigned int seq;
+	led_shm_t *shm;
+#ifdef BENCH_URING
+	struct bench_uring uring;
+#endif
+	char buf[4096];
+};
+
+struct bench_path {
+	const char *name;
+	int per_led;               /* 0 if the device mode does not matter */
+	int (*setup)(struct bench_thread *t);
+	int (*op)(struct bench_thread *t);
+	unsigned int cmds;         /* commands per op, 0 is 1 */
+};
+
+static unsigned int bench_leds[LED_MAX];
+static unsigned int bench_nleds;
+
+/* Alternate between two brightnesses so every op changes the LED */
+static unsigned int
+bench_brightness(struct bench_thread *t)
+{
+	return t->seq++ & 1 ? 255 : 64;
+}
+
+static int
+bench_open_led(struct bench_thread *t)
+{
+	t->fd = ddal_led_open(t->led);
+	return t->fd;
+}
+
+static int
+bench_open_proc(struct bench_thread *t)
+{
+	t->fd = open(DDAL_LED_PROC_PATH, O_RDONLY);
+	return t->fd;
+}
+
+static int
+bench_setup_binary(struct bench_thread *t)
+{
+	led_ioctl_format_t format = { .format = LED_FORMAT_BINARY };
+
+	if (bench_open_led(t) < 0)
+		return -1;
+	return ioctl(t->fd, LED_IOCTL_SET_FORMAT, &format);
+}
+
+static int
+bench_setup_nonblock(struct bench_thread *t)
+{
+	if (bench_setup_binary(t) < 0)
+		return -1;
+	return fcntl(t->fd, F_SETFL, fcntl(t->fd, F_GETFL) | O_NONBLOCK);
+}
+
+static int
+bench_setup_shm(struct bench_thread *t)
+{
+	if (bench_open_led(t) < 0)
+		return -1;
+
+	t->shm = mmap(NULL, LED_SHM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+		      t->fd, 0);
+	return t->shm == MAP_FAILED ? -1 : 0;
+}
+
+static int
+bench_write_text(struct bench_thread *t)
+{
+	return ddal_led_set_brightness(t->fd, bench_brightness(t));
+}
+
+static int
+bench_write_binary(struct bench_thread *t)
+{
+	led_cmd_t cmd = {
+		.op = LED_OP_BRIGHTNESS,
+		.value = bench_brightness(t),
+	};
+
+	return write(t->fd, &cmd, sizeof(cmd)) == sizeof(cmd) ? 0 : -1;
+}
+
+/* A full queue refuses the command but still does not block */
+static int
+bench_write_nonblock(struct bench_thread *t)
+{
+	if (bench_write_binary(t) < 0 && errno != EAGAIN)
+		return -1;
+	return 0;
+}
+
+static int
+bench_read(struct bench_thread *t)
+{
+	return ddal_led_get_brightness(t->fd);
+}
+
+static int
+bench_ioctl_toggle(struct bench_thread *t)
+{
+	return ddal_led_toggle(t->fd);
+}
+
+static int
+bench_ioctl_batch(struct bench_thread *t)
+{
+	led_cmd_t cmd = {
+		.led = t->led,
+		.op = LED_OP_BRIGHTNESS,
+		.value = bench_brightness(t),
+	};
+	led_ioctl_batch_t batch = {
+		.cmds = (unsigned long)&cmd,
+		.count = 1,
+	};
+
+	return ioctl(t->fd, LED_IOCTL_BATCH, &batch);
+}
+
+/* A store to the shared page, picked up by the engine on its own */
+static int
+bench_shm(struct bench_thread *t)
+{
+	t->shm->led[t->led].target = bench_brightness(t);
+	__atomic_fetch_add(&t->shm->generation, 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+#ifdef BENCH_URING
+static int
+bench_setup_uring(struct bench_thread *t)
+{
+	struct bench_uring *u = &t->uring;
+	struct io_uring_params p;
+
+	if (bench_open_led(t) < 0)
+		return -1;
+
+	memset(&p, 0, sizeof(p));
+	u->fd = syscall(__NR_io_uring_setup, BENCH_URING_DEPTH, &p);
+	if (u->fd < 0)
+		return -1;
+
+	u->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	u->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	u->sq_ring = mmap(NULL, u->sq_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	u->cq_ring = mmap(NULL, u->cq_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+	u->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+		       PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		       u->fd, IORING_OFF_SQES);
+	if (u->sq_ring == MAP_FAILED || u->cq_ring == MAP_FAILED ||
+	    u->sqes == MAP_FAILED)
+		return -1;
+
+	u->sq_tail = (unsigned int *)((char *)u->sq_ring + p.sq_off.tail);
+	u->sq_mask = (unsigned int *)((char *)u->sq_ring + p.sq_off.ring_mask);
+	u->sq_array = (unsigned int *)((char *)u->sq_ring + p.sq_off.array);
+	u->cq_head = (unsigned int *)((char *)u->cq_ring + p.cq_off.head);
+	u->cq_tail = (unsigned int *)((char *)u->cq_ring + p.cq_off.tail);
+	u->cq_mask = (unsigned int *)((char *)u->cq_ring + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)((char *)u->cq_ring + p.cq_off.cqes);
+
+	return 0;
+}
+
+/* BENCH_URING_DEPTH LED_IOCTL_CMDs with one io_uring_enter() */
+static int
+bench_uring_cmd(struct bench_thread *t)
+{
+	struct bench_uring *u = &t->uring;
+	unsigned int tail = *u->sq_tail, head, i, idx;
+	struct io_uring_sqe *sqe;
+	led_cmd_t cmd = { .op = LED_OP_BRIGHTNESS };
+	int err = 0;
+
+	for (i = 0; i < BENCH_URING_DEPTH; i++, tail++) {
+		idx = tail & *u->sq_mask;
+		sqe = &u->sqes[idx];
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->opcode = IORING_OP_URING_CMD;
+		sqe->fd = t->fd;
+		sqe->cmd_op = LED_IOCTL_CMD;
+		cmd.value = bench_brightness(t);
+		memcpy(sqe->cmd, &cmd, sizeof(cmd));
+		u->sq_array[idx] = idx;
+	}
+	__atomic_store_n(u->sq_tail, tail, __ATOMIC_RELEASE);
+
+	if (syscall(__NR_io_uring_enter, u->fd, BENCH_URING_DEPTH,
+		    BENCH_URING_DEPTH, IORING_ENTER_GETEVENTS, NULL, 0) < 0)
+		return -1;
+
+	head = *u->cq_head;
+	for (i = 0; i < BENCH_URING_DEPTH; i++, head++) {
+		if (u->cqes[head & *u->cq_mask].res < 0)
+			err = -u->cqes[head & *u->cq_mask].res;
+	}
+	__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+
+	if (err) {
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+static void
+bench_teardown_uring(struct bench_thread *t)
+{
+	struct bench_uring *u = &t->uring;
+
+	if (u->sq_ring && u->sq_ring != MAP_FAILED)
+		munmap(u->sq_ring, u->sq_size);
+	if (u->cq_ring && u->cq_ring != MAP_FAILED)
+		munmap(u->cq_ring, u->cq_size);
+	if (u->sqes && u->sqes != MAP_FAILED)
+		munmap(u->sqes, BENCH_URING_DEPTH * sizeof(struct io_uring_sqe));
+	if (u->fd > 0)
+		close(u->fd);
+}
+#endif
+
+/* The state of every LED in one call, what a telemetry scrape does */
+static int
+bench_snapshot(struct bench_thread *t)
+{
+	led_state_t states[LED_MAX];
+	led_ioctl_snapshot_t arg = {
+		.states = (unsigned long)states,
+		.count = LED_MAX,
+	};
+
+	return ioctl(t->fd, LED_IOCTL_SNAPSHOT, &arg);
+}
+
+static int
+bench_proc_read(struct bench_thread *t)
+{
+	return pread(t->fd, t->buf, sizeof(t->buf), 0) < 0 ? -1 : 0;
+}
+
+static const struct bench_path bench_paths[] = {
+	{ "write_text",     1, bench_open_led,       bench_write_text },
+	{ "write_binary",   1, bench_setup_binary,   bench_write_binary },
+	{ "write_nonblock", 1, bench_setup_nonblock, bench_write_nonblock },
+	{ "read",           1, bench_open_led,       bench_read },
+	{ "ioctl_toggle",   1, bench_open_led,       bench_ioctl_toggle },
+	{ "ioctl_batch",    1, bench_open_led,       bench_ioctl_batch },
+	{ "shm",            1, bench_setup_shm,      bench_shm },
+	{ "snapshot",       0, bench_open_led,       bench_snapshot },
+	{ "proc_read",      0, bench_open_proc,      bench_proc_read },
+#ifdef BENCH_URING
+	{ "uring_cmd",      1, bench_setup_uring,    bench_uring_cmd,
+	  BENCH_URING_DEPTH },
+#endif
+};
+
+#define BENCH_PATHS (sizeof(bench_paths) / sizeof(bench_paths[0]))
+
+static unsigned long long
+bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void *
+bench_thread_run(void *arg)
+{
+	struct bench_thread *t = arg;
+	unsigned long long before, after;
+	long i;
+
+	pthread_barrier_wait(t->start);
+
+	before = t->begin = bench_now();
+	for (i = 0; i < t->ops; i++) {
+		if (t->path->op(t) < 0) {
+			t->err = errno;
+			t->ops = i;
+			break;
+		}
+		after = bench_now();
+		t->lat[i] = (after - before) / (t->path->cmds ? t->path->cmds : 1);
+		before = after;
+	}
+	t->end = bench_now();
+
+	return NULL;
+}
+
+static int
+bench_cmp(const void *a, const void *b)
+{
+	unsigned long long x = *(const unsigned long long *)a;
+	unsigned long long y = *(const unsigned long long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static unsigned long long
+bench_percentile(const unsigned long long *lat, long n, double p)
+{
+	return n ? lat[(long)(p * (n - 1))] : 0;
+}
+
+static int
+bench_run(const struct bench_path *path, int nthreads, int different,
+	  long ops)
+{
+	struct bench_thread *threads;
+	pthread_barrier_t start;
+	unsigned long long *lat, begin, end, elapsed;
+	long total = 0, cmds;
+	int i, ret = 0;
+
+	threads = calloc(nthreads, sizeof(*threads));
+	lat = malloc(nthreads * ops * sizeof(*lat));
+	if (threads == NULL || lat == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	pthread_barrier_init(&start, NULL, nthreads + 1);
+
+	for (i = 0; i < nthreads; i++) {
+		threads[i].start = &start;
+		threads[i].path = path;
+		threads[i].led = bench_leds[different ? i % bench_nleds : 0];
+		threads[i].ops = ops;
+		threads[i].lat = lat + i * ops;
+		if (path->setup(&threads[i]) < 0) {
+			fprintf(stderr, "%s: led%u: %s\n", path->name,
+				threads[i].led, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		pthread_create(&threads[i].thread, NULL, bench_thread_run,
+			       &threads[i]);
+	}
+
+	pthread_barrier_wait(&start);
+
+	/* From the first thread starting to the last one finishing */
+	begin = ~0ULL;
+	end = 0;
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(threads[i].thread, NULL);
+		if (threads[i].begin < begin)
+			begin = threads[i].begin;
+		if (threads[i].end > end)
+			end = threads[i].end;
+	}
+	elapsed = end - begin;
+
+	/* Pack the latencies of all threads together */
+	for (i = 0; i < nthreads; i++) {
+		memmove(lat + total, threads[i].lat,
+			threads[i].ops * sizeof(*lat));
+		total += threads[i].ops;
+		if (threads[i].err) {
+			fprintf(stderr, "%s: %s\n", path->name,
+				strerror(threads[i].err));
+			ret = -1;
+		}
+		if (threads[i].shm)
+			munmap(threads[i].shm, LED_SHM_SIZE);
+#ifdef BENCH_URING
+		bench_teardown_uring(&threads[i]);
+#endif
+		close(threads[i].fd);
+	}
+	qsort(lat, total, sizeof(*lat), bench_cmp);
+	cmds = total * (path->cmds ? path->cmds : 1);
+
+	printf("led,%s,%d,%s,%ld,%.6f,%.0f,%llu,%llu,%llu,%llu,%llu\n",
+	       path->name, nthreads, different ? "different" : "same",
+	       cmds, elapsed / 1e9,
+	       elapsed ? cmds * 1e9 / elapsed : 0.0,
+	       bench_percentile(lat, total, 0.50),
+	       bench_percentile(lat, total, 0.90),
+	       bench_percentile(lat, total, 0.99),
+	       bench_percentile(lat, total, 0.999),
+	       total ? lat[total - 1] : 0);
+	fflush(stdout);
+
+	pthread_barrier_destroy(&start);
+	free(lat);
+	free(threads);
+	return ret;
+}
+
+/* Collect the indices of the /dev/ledN nodes present */
+static void
+bench_find_leds(void)
+{
+	char path[32];
+	unsigned int i;
+
+	for (i = 0; i < LED_MAX; i++) {
+		snprintf(path, sizeof(path), DDAL_LED_DEV_PATH "%u", i);
+		if (access(path, R_OK | W_OK) == 0)
+			bench_leds[bench_nleds++] = i;
+	}
+}
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [--threads=N] [--ops=N] [--path=NAME] "
+		"[--devices=same|different]\n"
+		"paths:", prog);
+	for (size_t i = 0; i < BENCH_PATHS; i++)
+		fprintf(stderr, " %s", bench_paths[i].name);
+	fprintf(stderr, "\n");
+	exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *only = NULL;
+	int same = 1, different = 1;
+	int nthreads = 1, t, i, ret = 0;
+	long ops = 100000;
+	size_t p;
+
+	for (i = 1; i < argc; i++) {
+		if (strncmp(argv[i], "--threads=", 10) == 0)
+			nthreads = atoi(argv[i] + 10);
+		else if (strncmp(argv[i], "--ops=", 6) == 0)
+			ops = atol(argv[i] + 6);
+		else if (strncmp(argv[i], "--path=", 7) == 0)
+			only = argv[i] + 7;
+		else if (strcmp(argv[i], "--devices=same") == 0)
+			different = 0;
+		else if (strcmp(argv[i], "--devices=different") == 0)
+			same = 0;
+		else
+			usage(argv[0]);
+	}
+	if (nthreads < 1 || ops < 1)
+		usage(argv[0]);
+
+	bench_find_leds();
+	if (bench_nleds == 0) {
+		fprintf(stderr, "no " DDAL_LED_DEV_PATH "N found\n");
+		return EXIT_FAILURE;
+	}
+
+	printf("module,path,threads,devices,ops,seconds,ops_per_sec,"
+	       "p50_ns,p90_ns,p99_ns,p999_ns,max_ns\n");
+
+	for (p = 0; p < BENCH_PATHS; p++) {
+		if (only && strcmp(only, bench_paths[p].name) != 0)
+			continue;
+		for (t = 1; t <= nthreads; t++) {
+			if (same && bench_run(&bench_paths[p], t, 0, ops) < 0)
+				ret = EXIT_FAILURE;
+			if (different && bench_paths[p].per_led &&
+			    bench_run(&bench_paths[p], t, 1, ops) < 0)
+				ret = EXIT_FAILURE;
+		}
+	}
+
+	return ret;
+}